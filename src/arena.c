@@ -0,0 +1,277 @@
+#include <u.h>
+#include <libc.h>
+#include "aux.h"
+#include "arena.h"
+
+enum {
+	ARENACHUNK = 64*1024,	/* default size of an arena's first chunk */
+	ARENAALIGN = 8,		/* alignment of all arena allocations */
+};
+
+/* create a new arena whose first chunk holds chunksize bytes.
+  * a chunksize of 0 selects the default. */
+arena *
+mkarena(long chunksize)
+{
+	arena *new;
+
+	if (chunksize < 0)
+		return nil;
+
+	new = ecalloc(1, sizeof(arena));
+	new->chunksize = (chunksize > 0) ? chunksize : ARENACHUNK;
+	new->chunks = nil;
+
+	return new;
+}
+
+/* give back the heap memory on ap's list of stragglers, newest first */
+static
+void
+runstragglers(arena *ap)
+{
+	straggler *sp;
+
+	for (sp = ap->stragglers; sp != nil; sp = sp->next)
+		sp->fn(sp->p);
+	ap->stragglers = nil;
+}
+
+/* release all chunks in ap, and everything allocated from them,
+  * along with the arenas merged into ap */
+void
+nukearena(arena *ap)
+{
+	chunk *cp, *next;
+	arena *mp, *link;
+
+	if (ap == nil)
+		return;
+
+	runstragglers(ap);
+
+	for (cp = ap->chunks; cp != nil; cp = next) {
+		next = cp->next;
+		free(cp);
+	}
+
+	for (mp = ap->merged; mp != nil; mp = link) {
+		link = mp->link;
+		nukearena(mp);
+	}
+
+	free(ap);
+}
+
+/* release all but the most recent chunk of ap, and empty it, so that
+  * ap can be refilled without going back to the heap. everything
+  * allocated from ap before is invalid afterwards, and its
+  * stragglers are given back. */
+void
+areset(arena *ap)
+{
+	chunk *cp, *next;
+	char *p;
+
+	if (ap == nil)
+		return;
+
+	runstragglers(ap);
+	if ((cp = ap->chunks) == nil)
+		return;
+
+	for (next = cp->next; next != nil; next = cp->next) {
+		cp->next = next->next;
+		free(next);
+	}
+
+	p = (char *)(cp + 1);
+	p += (ARENAALIGN - (uintptr)p % ARENAALIGN) % ARENAALIGN;
+	memset(p, 0, cp->p - p);
+	cp->p = p;
+}
+
+/* allocate a new chunk of at least n bytes and put it in front of ap's chunk list */
+static
+chunk *
+addchunk(arena *ap, long n)
+{
+	chunk *new;
+	long size;
+
+	size = ap->chunksize;
+	while (size < n)
+		size *= 2;
+	ap->chunksize = size * 2;
+
+	new = ecalloc(1, sizeof(chunk) + ARENAALIGN + size);
+	new->p = (char *)(new + 1);
+	new->p += (ARENAALIGN - (uintptr)new->p % ARENAALIGN) % ARENAALIGN;
+	new->ep = new->p + size;
+	new->next = ap->chunks;
+	ap->chunks = new;
+
+	return new;
+}
+
+/* return n bytes of zeroed memory from ap.
+  * if ap is nil, aalloc falls back to ecalloc. */
+void *
+aalloc(arena *ap, long n)
+{
+	chunk *cp;
+	void *p;
+
+	if (n < 0)
+		return nil;
+
+	if (ap == nil)
+		return ecalloc(1, n);
+
+	while (ap->into != nil)
+		ap = ap->into;
+
+	n = (n + ARENAALIGN - 1) & ~(ARENAALIGN - 1);
+
+	cp = ap->chunks;
+	if (cp == nil || cp->ep - cp->p < n)
+		cp = addchunk(ap, n);
+
+	p = cp->p;
+	cp->p += n;
+
+	return p;
+}
+
+/* duplicate s into ap, or onto the heap if ap is nil */
+char *
+astrdup(arena *ap, char *s)
+{
+	char *new;
+	long n;
+
+	if (s == nil)
+		return nil;
+
+	if (ap == nil)
+		return estrdup(s);
+
+	n = strlen(s) + 1;
+	new = aalloc(ap, n);
+	memmove(new, s, n);
+
+	return new;
+}
+
+/* convert s into runes like estrrunedup, storing the result in ap
+  * or on the heap if ap is nil. the runes are decoded straight
+  * into ap, without a temporary copy. */
+Rune *
+astrrunedup(arena *ap, char *s)
+{
+	Rune *new, *r;
+
+	if (s == nil)
+		return nil;
+
+	if (ap == nil)
+		return estrrunedup(s);
+
+	new = aalloc(ap, (utflen(s) + 1) * sizeof(Rune));
+	for (r = new; *s != '\0'; r++)
+		s += chartorune(r, s);
+	*r = L'\0';
+
+	return new;
+}
+
+/* return 1 if p points into memory allocated from ap, 0 otherwise */
+int
+inarena(arena *ap, void *p)
+{
+	chunk *cp;
+
+	if (ap == nil || p == nil)
+		return 0;
+
+	while (ap->into != nil)
+		ap = ap->into;
+
+	for (cp = ap->chunks; cp != nil; cp = cp->next)
+		if ((char *)p >= (char *)(cp + 1) && (char *)p < cp->ep)
+			return 1;
+
+	return 0;
+}
+
+/* free p, unless it was allocated from ap; arena memory is only
+  * released by nukearena */
+void
+afree(arena *ap, void *p)
+{
+	if (inarena(ap, p) == 0)
+		free(p);
+}
+
+/* move all chunks and stragglers of src into dst. memory allocated
+  * from src stays valid until dst is nuked. src is kept, empty, for
+  * the records that still point at it: it allocates from dst from now
+  * on, and is freed by nukearena(dst), so it must not be nuked itself. */
+void
+amerge(arena *dst, arena *src)
+{
+	chunk *cp;
+	straggler *sp;
+
+	if (dst == nil || src == nil || src == dst)
+		return;
+
+	while (dst->into != nil)
+		dst = dst->into;
+
+	if (src->stragglers != nil) {
+		for (sp = src->stragglers; sp->next != nil; sp = sp->next)
+			;
+		sp->next = dst->stragglers;
+		dst->stragglers = src->stragglers;
+		src->stragglers = nil;
+	}
+
+	if (src->chunks != nil) {
+		for (cp = src->chunks; cp->next != nil; cp = cp->next)
+			;
+		if (dst->chunks == nil) {
+			dst->chunks = src->chunks;
+		} else {
+			/* keep dst's current chunk in front, since aalloc only allocates from the first chunk */
+			cp->next = dst->chunks->next;
+			dst->chunks->next = src->chunks;
+		}
+	}
+
+	src->chunks = nil;
+	src->into = dst;
+	src->link = dst->merged;
+	dst->merged = src;
+}
+
+/* have fn(p) called when ap is nuked or reset, to give back heap
+  * memory that a record in ap holds on to. this lets ap be released
+  * without visiting its records. the list lives in ap itself */
+void
+adefer(arena *ap, void (*fn)(void *), void *p)
+{
+	straggler *new;
+
+	if (ap == nil || fn == nil)
+		return;
+
+	while (ap->into != nil)
+		ap = ap->into;
+
+	new = aalloc(ap, sizeof(straggler));
+	new->fn = fn;
+	new->p = p;
+	new->next = ap->stragglers;
+	ap->stragglers = new;
+}
@@ -0,0 +1,37 @@
+/* chunked bump allocator for parse-time allocations */
+typedef struct chunk chunk;
+typedef struct chunk {
+	chunk *next;		/* previously allocated chunk */
+	char *p;			/* next free byte */
+	char *ep;			/* end of chunk */
+} chunk;
+
+/* heap memory held by a record in an arena, such as a reference into
+  * a shared pool; fn(p) gives it back when the arena is nuked or reset */
+typedef struct straggler straggler;
+typedef struct straggler {
+	straggler *next;
+	void (*fn)(void *);
+	void *p;
+} straggler;
+
+typedef struct arena arena;
+typedef struct arena {
+	chunk *chunks;	/* most recently allocated chunk first */
+	long chunksize;	/* size of the next chunk; doubles on every new chunk */
+	straggler *stragglers;	/* most recently added first; see adefer */
+	arena *into;		/* arena that took this one's chunks in amerge, and serves its allocations */
+	arena *merged;	/* arenas merged into this one; freed along with it */
+	arena *link;		/* next arena in into->merged */
+} arena;
+
+arena *mkarena(long chunksize);
+void nukearena(arena *ap);
+void areset(arena *ap);
+void *aalloc(arena *ap, long n);
+char *astrdup(arena *ap, char *s);
+Rune *astrrunedup(arena *ap, char *s);
+int inarena(arena *ap, void *p);
+void afree(arena *ap, void *p);
+void amerge(arena *dst, arena *src);
+void adefer(arena *ap, void (*fn)(void *), void *p);
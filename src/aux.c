@@ -12,51 +12,35 @@
 Rune *
 strrunedup(char *s)
 {
-	int nrune = 0;
-	int maxrune = 16;
-	int i, j;
-	Rune *out;
+	Rune *out, *r;
+	char *p;
+	int n;
 
 	if (s == nil)
 		return nil;
 
-	out = calloc(maxrune, sizeof(Rune));
+	/* utflen steps through s like chartorune, so it counts
+	  * exactly the runes decoded below */
+	out = malloc((utflen(s) + 1) * sizeof(Rune));
 	if (out == nil)
 		return nil;
 
-	for (i = 0; s[i] != '\0'; i++) {
-		if (nrune+1 > maxrune) {
-			maxrune *= 2;
-			out = realloc(out, sizeof(Rune) * maxrune);
-
-			if (out == nil)
-				return nil;
-		}
-
-		if ((uchar)s[i] < Runeself) {
-			out[nrune++] = (Rune)s[i];
+	for (p = s, r = out; *p != '\0'; r++) {
+		if ((uchar)*p < Runeself) {
+			*r = (uchar)*p++;
 			continue;
 		}
-		char buf[UTFmax];
-		buf[0] = s[i++];
-
-		for (j = 1;;i++) {
-			if (s[i] == '\0') {
-				out[0] = Runeerror;
-				out[1] = '\0';
-				werrstr("unexpected end of string at position %d", i);
-
-				return out;
-			}
-			buf[j++] = s[i];
-			if (fullrune(buf, j)) {
-				chartorune(out+nrune, buf);
-				nrune++;
-				break;
-			}
+		n = chartorune(r, p);
+		if (*r == Runeerror && fullrune(p, strlen(p)) == 0) {
+			out[0] = Runeerror;
+			out[1] = '\0';
+			werrstr("unexpected end of string at position %d", (int)(p - s));
+
+			return out;
 		}
+		p += n;
 	}
-	out[nrune] = (Rune)'\0';
+	*r = (Rune)'\0';
 
 	return out;
 }
@@ -116,4 +100,188 @@ fact(int n)
 		o *= n;
 
 	return o;
-}
\ No newline at end of file
+}
+
+/* exactly representable powers of ten, for spantod's fast path */
+static double pow10tab[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+/* return 1 if c could continue a number for strtod or atol */
+static
+int
+isnumtail(int c)
+{
+	return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '.';
+}
+
+/* copy the n bytes at s into buf, or into a malloc'd string if they do
+  * not fit, and null-terminate them. the slow paths of spantol and
+  * spantod hand the copy to the library routines. */
+static
+char *
+spandup(char *s, long n, char *buf, long nbuf)
+{
+	char *p;
+
+	p = (n < nbuf) ? buf : ecalloc(n + 1, sizeof(char));
+	memmove(p, s, n);
+	p[n] = '\0';
+
+	return p;
+}
+
+/* convert the n bytes at s to a long, with the same result as atol.
+  * if n is negative, s is null-terminated. plain decimal integers of
+  * up to 9 digits are converted directly; anything else (whitespace,
+  * leading zeroes, longer numbers) goes through atol. */
+long
+spantol(char *s, long n)
+{
+	char buf[64], *p;
+	long i, j, v;
+	int neg;
+
+	if (s == nil)
+		return 0;
+
+	i = 0;
+	neg = 0;
+	if (i != n && (s[i] == '-' || s[i] == '+'))
+		neg = s[i++] == '-';
+
+	v = 0;
+	for (j = i; j != n && j - i < 10 && s[j] >= '0' && s[j] <= '9'; j++)
+		v = v * 10 + s[j] - '0';
+
+	if (j > i && j - i < 10 && (s[i] != '0' || j - i == 1) && (j == n || !isnumtail(s[j])))
+		return neg ? -v : v;
+
+	if (n < 0)
+		return atol(s);
+
+	p = spandup(s, n, buf, sizeof(buf));
+	v = atol(p);
+	if (p != buf)
+		free(p);
+
+	return v;
+}
+
+/* convert the n bytes at s to a double, with the same result as strtod.
+  * if n is negative, s is null-terminated. numbers of the form [-]ddd[.ddd]
+  * whose digits fit in 53 bits, with at most 22 digits after the point,
+  * are converted with a single division of two exact doubles, which is
+  * correctly rounded (Clinger's fast path); anything else goes through strtod. */
+double
+spantod(char *s, long n)
+{
+	char buf[64], *p;
+	uvlong m;
+	long i, nd, nf;
+	int neg, point;
+	double d;
+
+	if (s == nil)
+		return 0;
+
+	i = 0;
+	neg = 0;
+	if (i != n && (s[i] == '-' || s[i] == '+'))
+		neg = s[i++] == '-';
+
+	m = 0;
+	nd = nf = 0;
+	point = 0;
+	for (; i != n; i++) {
+		if (s[i] >= '0' && s[i] <= '9') {
+			m = m * 10 + s[i] - '0';
+			if (m >= 1ULL<<53)
+				goto slow;
+			nd++;
+			nf += point;
+		} else if (s[i] == '.' && !point) {
+			point = 1;
+		} else
+			break;
+	}
+
+	if (nd == 0 || nf >= nelem(pow10tab) || (i != n && isnumtail(s[i])))
+		goto slow;
+
+	d = (double)m / pow10tab[nf];
+	return neg ? -d : d;
+
+slow:
+	if (n < 0)
+		return strtod(s, nil);
+
+	p = spandup(s, n, buf, sizeof(buf));
+	d = strtod(p, nil);
+	if (p != buf)
+		free(p);
+
+	return d;
+}
+
+/* write the decimal digits of v into buf, which must hold at least 21 bytes.
+  * returns the number of bytes written, excluding the terminating null. */
+int
+ltostr(char *buf, vlong v)
+{
+	char tmp[24], *p;
+	uvlong u;
+	int n;
+
+	u = (v < 0) ? -(uvlong)v : v;
+	p = tmp + sizeof(tmp);
+	do {
+		*--p = '0' + u % 10;
+		u /= 10;
+	} while (u != 0);
+	if (v < 0)
+		*--p = '-';
+
+	n = tmp + sizeof(tmp) - p;
+	memmove(buf, p, n);
+	buf[n] = '\0';
+
+	return n;
+}
+
+/* write v into buf formatted like "%.precG", for prec up to 17;
+  * buf must hold at least 32 bytes. integral values whose magnitude is
+  * below lim[prec] = 10^(prec-1) are written with ltostr, everything
+  * else goes through snprint.
+  * returns the number of bytes written, excluding the terminating null. */
+int
+dtostr(char *buf, double v, int prec)
+{
+	static vlong lim[] = {
+		1, 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000,
+		100000000, 1000000000, 10000000000LL, 100000000000LL,
+		1000000000000LL, 10000000000000LL, 100000000000000LL,
+		1000000000000000LL,
+	};
+	union {
+		double d;
+		uvlong u;
+	} bits;
+	vlong n;
+
+	if (prec < 0)
+		prec = 6;
+	if (prec == 0)
+		prec = 1;
+
+	/* -0.0 is integral, but ltostr would drop its sign */
+	bits.d = v;
+	if (prec < nelem(lim) && v > -1e15 && v < 1e15 && (v != 0 || (bits.u >> 63) == 0)) {
+		n = v;
+		if (n == v && n < lim[prec] && n > -lim[prec])
+			return ltostr(buf, n);
+	}
+
+	return snprint(buf, 32, "%.*G", prec, v);
+}
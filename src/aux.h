@@ -4,4 +4,8 @@ Rune *estrrunedup(char *s);
 void *ecalloc(int n, int size);
 void *erealloc(void *p, int n);
 char *estrdup(char *s);
-double fact(int n);
\ No newline at end of file
+double fact(int n);
+long spantol(char *s, long n);
+double spantod(char *s, long n);
+int ltostr(char *buf, vlong v);
+int dtostr(char *buf, double v, int prec);
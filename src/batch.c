@@ -0,0 +1,362 @@
+#include <u.h>
+#include <libc.h>
+#include <bio.h>
+#include <thread.h>
+#include "aux.h"
+#include "arena.h"
+#include "hash.h"
+#include "hitsound.h"
+#include "hitobject.h"
+#include "rgbline.h"
+#include "beatmap.h"
+#include "batch.h"
+
+enum {
+	STACK = 64*1024,	/* stack size of worker procs */
+	SLICEMIN = 64*1024,	/* smallest number of bytes worth handing to a proc of its own */
+};
+
+/* state shared between the workers of one readmaps call */
+typedef struct batch {
+	Lock lk;
+	mapjob *jobs;
+	int njob;
+	int next;		/* index of the next job to hand out */
+	Channel *done;	/* workers send on this once there are no jobs left */
+} batch;
+
+/* read, and optionally write back, the map in jp.
+  * runs in a worker proc; errstr is per-proc, so it is
+  * copied into jp->err before the proc moves on. */
+static
+void
+runjob(mapjob *jp)
+{
+	beatmap *bmp;
+	Biobuf *bp;
+	int fd;
+
+	jp->bmp = nil;
+	jp->err[0] = '\0';
+
+	if ((fd = open(jp->file, OREAD)) < 0) {
+		jp->exit = BADARGS;
+		rerrstr(jp->err, sizeof(jp->err));
+		return;
+	}
+
+	bmp = mkbeatmap();
+	bmp->arena = mkarena(0);
+	bmp->pool = jp->pool;
+	bmp->samppool = jp->samppool;
+	jp->exit = readmapfd(fd, bmp);
+	close(fd);
+
+	if (jp->exit == 0 && jp->outfile != nil) {
+		if ((bp = Bopen(jp->outfile, OWRITE)) == nil) {
+			jp->exit = BADARGS;
+		} else {
+			jp->exit = writemap(bp, bmp);
+			Bterm(bp);
+		}
+	}
+
+	if (jp->exit < 0)
+		rerrstr(jp->err, sizeof(jp->err));
+
+	if (jp->exit == 0 && jp->keep)
+		jp->bmp = bmp;
+	else
+		nukebeatmap(bmp);
+}
+
+static
+void
+mapworker(void *v)
+{
+	batch *b;
+	int i;
+
+	b = v;
+	for (;;) {
+		lock(&b->lk);
+		i = b->next++;
+		unlock(&b->lk);
+
+		if (i >= b->njob)
+			break;
+		runjob(&b->jobs[i]);
+	}
+
+	sendul(b->done, 0);
+}
+
+/* read the njob maps in jobs on nproc worker procs. results are
+  * stored in each job, so they come out in the order of jobs[]
+  * no matter which proc finished first.
+  * returns the number of failed jobs, or negative values on bad arguments. */
+int
+readmaps(mapjob *jobs, int njob, int nproc)
+{
+	batch b;
+	int i, nfail;
+
+	if (jobs == nil || njob < 0)
+		return BADARGS;
+
+	if (nproc < 1)
+		nproc = 1;
+	if (nproc > njob)
+		nproc = njob;
+
+	memset(&b, 0, sizeof(b));
+	b.jobs = jobs;
+	b.njob = njob;
+	b.next = 0;
+	b.done = chancreate(sizeof(ulong), nproc);
+
+	for (i = 0; i < nproc; i++)
+		proccreate(mapworker, &b, STACK);
+	for (i = 0; i < nproc; i++)
+		recvul(b.done);
+
+	chanfree(b.done);
+
+	nfail = 0;
+	for (i = 0; i < njob; i++)
+		if (jobs[i].exit < 0)
+			nfail++;
+
+	return nfail;
+}
+
+/* a line-aligned part of a section parsed by readlines */
+typedef struct slice {
+	int sec;		/* STIMINGPOINTS or SHITOBJECTS */
+	char *p;		/* first byte of the slice */
+	char *ep;		/* end of the slice */
+	arena *arena;	/* private arena of the slice, or nil */
+	samppool *samppool;	/* hitsamples are shared through it, if non-nil */
+
+	void **v;		/* lines or objects parsed so far, in file order */
+	int nv;
+	int exit;
+	char err[ERRMAX];
+	Channel *done;
+} slice;
+
+/* parse every non-empty line of sp into sp->v, stopping at the first failure */
+static
+void
+parseslice(slice *sp)
+{
+	char *ln, *nl, *last, *q;
+	long n;
+	int maxv;
+	hitobject *op;
+	rgline *lp;
+	void *v;
+
+	maxv = 256;
+	sp->v = ecalloc(maxv, sizeof(void *));
+	sp->nv = 0;
+	sp->exit = 0;
+	sp->err[0] = '\0';
+
+	last = nil;
+	for (ln = sp->p; ln < sp->ep; ln = nl + 1) {
+		if ((nl = memchr(ln, '\n', sp->ep - ln)) != nil) {
+			*nl = '\0';
+			n = nl - ln;
+		} else {
+			/* unterminated final line; the byte at ep may not be ours */
+			n = sp->ep - ln;
+			last = ecalloc(n + 1, sizeof(char));
+			memmove(last, ln, n);
+			ln = last;
+			nl = sp->ep;
+		}
+
+		if (n > 0 && ln[n-1] == '\r')
+			ln[--n] = '\0';
+
+		for (q = ln; *q == ' ' || *q == '\t' || *q == '\r'; q++)
+			;
+		if (*q == '\0')
+			continue;
+
+		if (sp->sec == SHITOBJECTS) {
+			sp->exit = strtoobj(sp->arena, sp->samppool, ln, &op);
+			v = op;
+		} else {
+			sp->exit = strtoline(sp->arena, ln, &lp);
+			v = lp;
+		}
+
+		if (sp->exit < 0) {
+			rerrstr(sp->err, sizeof(sp->err));
+			break;
+		}
+
+		if (sp->nv == maxv) {
+			maxv *= 2;
+			sp->v = erealloc(sp->v, maxv * sizeof(void *));
+		}
+		sp->v[sp->nv++] = v;
+	}
+
+	free(last);
+}
+
+static
+void
+sliceworker(void *v)
+{
+	slice *sp;
+
+	sp = v;
+	parseslice(sp);
+	sendul(sp->done, 0);
+}
+
+/* parse the [TimingPoints] or [HitObjects] lines between p and ep, split
+  * at line boundaries across up to nproc procs, into *vp. lines are
+  * null-terminated in place, as in readmapbuf. the parsed lines or
+  * objects are stored in a malloc'd array in file order, so that the
+  * caller can load them exactly as if they were read one by one;
+  * everything is allocated from arp, or from the heap if arp is nil,
+  * and hitsamples are shared through pp if it is non-nil.
+  * on failure, *vp holds everything up to the first bad line.
+  * this routine sets errstr
+  * returns 0 on success, negative values on failure. */
+int
+readlines(arena *arp, samppool *pp, int sec, char *p, char *ep, int nproc, void ***vp, int *nvp)
+{
+	slice *slices;
+	Channel *done;
+	char *b, *nl;
+	int nslice, i, j, nv, exit;
+
+	if (p == nil || ep < p || vp == nil || nvp == nil)
+		return BADARGS;
+	if (sec != STIMINGPOINTS && sec != SHITOBJECTS)
+		return BADARGS;
+
+	nslice = (ep - p) / SLICEMIN;
+	if (nslice > nproc)
+		nslice = nproc;
+	if (nslice < 1)
+		nslice = 1;
+
+	slices = ecalloc(nslice, sizeof(slice));
+	done = chancreate(sizeof(ulong), nslice);
+	for (i = 0, b = p; i < nslice; i++) {
+		slices[i].sec = sec;
+		slices[i].p = b;
+		if (i < nslice - 1 && b < p + (ep - p) / nslice * (i + 1))
+			b = p + (ep - p) / nslice * (i + 1);
+		if (i == nslice - 1 || (nl = memchr(b, '\n', ep - b)) == nil)
+			b = ep;
+		else
+			b = nl + 1;
+		slices[i].ep = b;
+		slices[i].arena = (arp != nil && nslice > 1) ? mkarena(0) : arp;
+		slices[i].samppool = pp;
+		slices[i].done = done;
+	}
+
+	if (nslice == 1)
+		parseslice(&slices[0]);
+	else {
+		for (i = 0; i < nslice; i++)
+			proccreate(sliceworker, &slices[i], STACK);
+		for (i = 0; i < nslice; i++)
+			recvul(done);
+	}
+	chanfree(done);
+
+	/* hand the private arenas over before anything is freed */
+	for (i = 0; i < nslice; i++)
+		if (slices[i].arena != arp)
+			amerge(arp, slices[i].arena);
+
+	nv = 0;
+	for (i = 0; i < nslice; i++)
+		nv += slices[i].nv;
+	*vp = ecalloc(nv + 1, sizeof(void *));
+
+	exit = 0;
+	for (i = nv = 0; i < nslice; i++) {
+		if (exit == 0) {
+			memmove(*vp + nv, slices[i].v, slices[i].nv * sizeof(void *));
+			nv += slices[i].nv;
+			if ((exit = slices[i].exit) < 0)
+				werrstr("%s", slices[i].err);
+		} else {
+			/* past the first failure; the serial loader never gets this far */
+			for (j = 0; j < slices[i].nv; j++)
+				if (sec == SHITOBJECTS)
+					anukeobj(arp, slices[i].v[j]);
+				else
+					anukergline(arp, slices[i].v[j]);
+		}
+		free(slices[i].v);
+	}
+	*nvp = nv;
+	free(slices);
+
+	return exit;
+}
+
+/* let readmap, readmapbuf and loadsection parse large sections of maps
+  * with bmp->nproc > 1 on several procs, through readlines */
+void
+initsplit(void)
+{
+	splitlines = readlines;
+}
+
+static
+int
+jobcmp(void *a, void *b)
+{
+	return strcmp(((mapjob *)a)->file, ((mapjob *)b)->file);
+}
+
+/* create a job for every .osu file in dir, sorted by file name,
+  * and store the malloc'd array in *jobsp. each job's file is
+  * malloc'd as well.
+  * this routine sets errstr
+  * returns the number of jobs, or negative values on failure. */
+int
+mapjobsdir(char *dir, mapjob **jobsp)
+{
+	Dir *d;
+	mapjob *jobs;
+	long nd, i;
+	int fd, n, len;
+
+	if (dir == nil || jobsp == nil)
+		return BADARGS;
+
+	if ((fd = open(dir, OREAD)) < 0)
+		return BADARGS;
+	nd = dirreadall(fd, &d);
+	close(fd);
+	if (nd < 0)
+		return BADARGS;
+
+	jobs = ecalloc(nd + 1, sizeof(mapjob));
+	for (i = n = 0; i < nd; i++) {
+		len = strlen(d[i].name);
+		if ((d[i].mode & DMDIR) || len < 4 || cistrcmp(d[i].name + len - 4, ".osu") != 0)
+			continue;
+		jobs[n++].file = smprint("%s/%s", dir, d[i].name);
+	}
+	free(d);
+
+	qsort(jobs, n, sizeof(mapjob), jobcmp);
+	*jobsp = jobs;
+
+	return n;
+}
@@ -0,0 +1,18 @@
+/* multi-proc batch ingestion of beatmap files.
+  * programs using readmaps must be built with libthread, and define threadmain */
+typedef struct mapjob {
+	char *file;		/* .osu file to read */
+	char *outfile;	/* if non-nil, write the parsed map back out to this file */
+	int keep;		/* keep the parsed map in bmp; otherwise it is freed once done */
+	strpool *pool;	/* optional; entry strings are interned here. jobs may share a pool */
+	samppool *samppool;	/* optional; hitsamples are shared through it. jobs may share a pool */
+
+	beatmap *bmp;	/* parsed map, if keep is set and reading succeeded */
+	int exit;		/* 0 on success, negative values on failure */
+	char err[ERRMAX];	/* errstr of a failed job */
+} mapjob;
+
+int readmaps(mapjob *jobs, int njob, int nproc);
+int mapjobsdir(char *dir, mapjob **jobsp);
+int readlines(arena *arp, samppool *pp, int sec, char *p, char *ep, int nproc, void ***vp, int *nvp);
+void initsplit(void);
@@ -2,6 +2,7 @@
 #include <libc.h>
 #include <bio.h>
 #include "aux.h"
+#include "arena.h"
 #include "hash.h"
 #include "hitsound.h"
 #include "hitobject.h"
@@ -17,7 +18,7 @@
 
 kvdef kvgeneral[] = {
 	/* [General] */
-	{.key = "AudioFilename", .fmt = "%s: %S", .type = TRUNE},
+	{.key = "AudioFilename", .fmt = "%s: %s", .type = TRUNE},
 	{.key = "AudioLeadIn", .fmt = "%s: %ld", .type = TLONG},
 	{.key = "PreviewTime", .fmt = "%s: %ld", .type = TLONG},
 	{.key = "Countdown", .fmt = "%s: %d", .type = TINT},
@@ -51,9 +52,9 @@ kvdef kveditor[] = {
 kvdef kvmetadata[] = {
 	/* [Metadata] */
 	{.key = "Title", .fmt = "%s:%s", .type = TSTRING},
-	{.key = "TitleUnicode", .fmt = "%s:%S", .type = TRUNE},
+	{.key = "TitleUnicode", .fmt = "%s:%s", .type = TRUNE},
 	{.key = "Artist", .fmt = "%s:%s", .type = TSTRING},
-	{.key = "ArtistUnicode", .fmt = "%s:%S", .type = TRUNE},
+	{.key = "ArtistUnicode", .fmt = "%s:%s", .type = TRUNE},
 	{.key = "Creator", .fmt = "%s:%s", .type = TSTRING},
 	{.key = "Version", .fmt = "%s:%s", .type = TSTRING},
 	{.key = "Source", .fmt = "%s:%s", .type = TSTRING},
@@ -96,6 +97,9 @@ int nkvmetadata = sizeof(kvmetadata) / sizeof(kvdef);
 int nkvdifficulty = sizeof(kvdifficulty) / sizeof(kvdef);
 int nkvcolours =  sizeof(kvcolours) / sizeof(kvdef);
 
+/* parallel parser for large sections; nil unless a program installs one */
+int (*splitlines)(arena *arp, samppool *pp, int sec, char *p, char *ep, int nproc, void ***vp, int *nvp);
+
 /* Field labels for key:value pairs */
 enum {
 	KEY=0,
@@ -103,6 +107,14 @@ enum {
 };
 int maxkvfields = VALUE + 1;
 
+/* pipe-separated lists (anchors, edge sounds and sets) with up to
+  * NFIELDS entries are split without touching the heap; see csvfields.
+  * records with up to NTOKS fields, items and parts likewise; see tokline */
+enum {
+	NFIELDS = 64,
+	NTOKS = 128,
+};
+
 /* CSV field labels for hitobject entries
   * See: https://osu.ppy.sh/wiki/en/osu%21_File_Formats/Osu_%28file_format%29#hit-objects
   */
@@ -185,6 +197,91 @@ enum {
 	SLADDSET,
 };
 
+/* how tokline splits a record; see objseps */
+enum {
+	TKCOMMA = 0x1,		/* fields at ',', collapsing runs, as csvsplit does */
+	TKPIPE = 0x2,		/* items at '|' */
+	TKCOLON = 0x4,		/* parts at ':' */
+	TKRUNS = 0x8,		/* collapse runs of ':', as csvsplit does */
+	TKOBJ = 0x10,		/* pick the above per field from the object type */
+};
+
+/* what starts a token */
+enum {
+	TKFIELD=0,
+	TKITEM,
+	TKPART,
+};
+
+/* a record split into tokens: its comma-separated fields and, in the
+  * fields that have them, the '|' items and ':' parts nested inside, in
+  * line order. up to NTOKS tokens are kept without touching the heap. */
+typedef struct linetok {
+	char **tok;		/* start of each token */
+	char **end;		/* end of each token */
+	uchar *lvl;		/* what starts each token */
+	int ntok;
+	int maxtok;
+	int field[OBJSLIDERHITSAMP+2];	/* first token of each field; field[nfield] is ntok */
+	int nfield;
+
+	char *stok[NTOKS];
+	char *send[NTOKS];
+	uchar slvl[NTOKS];
+} linetok;
+
+typedef struct section {
+	char *header;		/* section header, brackets included */
+	kvdef *kvlist;		/* key-value definitions; nil for non-kv sections */
+	int *nkvlist;		/* number of kvdefs in kvlist */
+	int wstrip;		/* strip whitespace around the kv delimiter */
+} section;
+
+static section sections[] = {
+	[SGENERAL] = {.header = "[General]", .kvlist = kvgeneral, .nkvlist = &nkvgeneral, .wstrip = 1},
+	[SEDITOR] = {.header = "[Editor]", .kvlist = kveditor, .nkvlist = &nkveditor, .wstrip = 1},
+	[SMETADATA] = {.header = "[Metadata]", .kvlist = kvmetadata, .nkvlist = &nkvmetadata, .wstrip = 0},
+	[SDIFFICULTY] = {.header = "[Difficulty]", .kvlist = kvdifficulty, .nkvlist = &nkvdifficulty, .wstrip = 1},
+	[SEVENTS] = {.header = "[Events]"},
+	[STIMINGPOINTS] = {.header = "[TimingPoints]"},
+	[SCOLOURS] = {.header = "[Colours]", .kvlist = kvcolours, .nkvlist = &nkvcolours, .wstrip = 1},
+	[SHITOBJECTS] = {.header = "[HitObjects]"},
+};
+
+/* bulk loading state for readdirective; lists are put in order once loading is done */
+typedef struct loader {
+	hitobject *otail;	/* last object loaded into bmp->objects */
+	rgline *ltail;		/* last line loaded into bmp->rglines */
+} loader;
+
+/* keys gathered by scanmapinfo */
+typedef struct infokey {
+	int bit;		/* one of enum mapinfobits */
+	int sec;		/* section the key lives in */
+	char *key;
+} infokey;
+
+static infokey infokeys[] = {
+	{MIMODE, SGENERAL, "Mode"},
+	{MITITLE, SMETADATA, "Title"},
+	{MIARTIST, SMETADATA, "Artist"},
+	{MICREATOR, SMETADATA, "Creator"},
+	{MIVERSION, SMETADATA, "Version"},
+	{MIBEATMAPID, SMETADATA, "BeatmapID"},
+	{MIBEATMAPSETID, SMETADATA, "BeatmapSetID"},
+	{MIHP, SDIFFICULTY, "HPDrainRate"},
+	{MICS, SDIFFICULTY, "CircleSize"},
+	{MIOD, SDIFFICULTY, "OverallDifficulty"},
+	{MIAR, SDIFFICULTY, "ApproachRate"},
+};
+
+/* in-place line scanner over a contiguous buffer; see readmapbuf */
+typedef struct scanner {
+	char *p;		/* start of the next unread line */
+	char *ep;		/* end of buffer */
+	char *last;		/* malloc'd copy of an unterminated final line */
+} scanner;
+
 /* return 0 if line contains any characters besides spaces, tabs or carriage returns */
 static
 int
@@ -236,11 +333,12 @@ nextline(Biobuf *bp)
 	return nil;
 }
 
-/* read lines from bp up until the next section header (e.g. "[General]"), and return the header.
-  * returns nil on end-of-file. */
+/* read the next configuration directive from bp, and
+  * return it, skipping empty lines.
+  * returns nil at the next section header, or end-of-file. */
 static
 char *
-nextsection(Biobuf *bp)
+nextdirective(Biobuf *bp)
 {
 	char *ln;
 
@@ -248,8 +346,12 @@ nextsection(Biobuf *bp)
 		return nil;
 
 	while ((ln = nextline(bp)) != nil) {
-		if (isheader(ln) == 1)
+		if (isheader(ln) == 1) {
+			Bseek(bp, -(Blinelen(bp)+1), 1);
+			return nil;
+		} else if (isempty(ln) == 0) {
 			return ln;
+		}
 		free(ln);
 	}
 
@@ -257,32 +359,105 @@ nextsection(Biobuf *bp)
 	return nil;
 }
 
-/* read the next configuration directive from bp, and
-  * return it, skipping empty lines.
-  * returns nil at the next section header, or end-of-file. */
+/* return the next line in sp, null-terminated in place with the trailing
+  * carriage return stripped. an unterminated final line is copied into
+  * sp->last, which the caller must free.
+  * returns nil at the end of the buffer. */
 static
 char *
-nextdirective(Biobuf *bp)
+scanline(scanner *sp)
 {
-	char *ln;
+	char *ln, *nl;
+	long n;
 
-	if (bp == nil)
+	if (sp == nil || sp->p >= sp->ep)
 		return nil;
 
-	while ((ln = nextline(bp)) != nil) {
-		if (isheader(ln) == 1) {
-			Bseek(bp, -(Blinelen(bp)+1), 1);
-			return nil;
-		} else if (isempty(ln) == 0) {
-			return ln;
-		}
-		free(ln);
+	ln = sp->p;
+	if ((nl = memchr(ln, '\n', sp->ep - ln)) != nil) {
+		*nl = '\0';
+		sp->p = nl + 1;
+		n = nl - ln;
+	} else {
+		n = sp->ep - ln;
+		free(sp->last);
+		sp->last = ecalloc(n + 1, sizeof(char));
+		memmove(sp->last, ln, n);
+		ln = sp->last;
+		sp->p = sp->ep;
+	}
+
+	if (n > 0 && ln[n-1] == '\r')
+		ln[n-1] = '\0';
+
+	return ln;
+}
+
+/* return the index into sections[] of the section header s,
+  * or -1 if s is not a known section */
+static
+int
+lookupsection(char *s)
+{
+	int i;
+
+	if (s == nil)
+		return -1;
+
+	for (i = 0; i < NSECTION; i++)
+		if (strcmp(s, sections[i].header) == 0)
+			return i;
+
+	return -1;
+}
+
+/* return the table in bmp that section sec deserialises into,
+  * or nil if sec is not a key-value section */
+static
+table *
+sectiontable(beatmap *bmp, int sec)
+{
+	switch (sec) {
+	case SGENERAL:
+		return bmp->general;
+	case SEDITOR:
+		return bmp->editor;
+	case SMETADATA:
+		return bmp->metadata;
+	case SDIFFICULTY:
+		return bmp->difficulty;
+	case SCOLOURS:
+		return bmp->colours;
 	}
 
-	/* end-of-file */
 	return nil;
 }
 
+/* append ln and a carriage return-newline pair to the malloc'd string *sp,
+  * which holds *np characters in *maxp bytes of storage. */
+static
+void
+appendline(char **sp, int *np, int *maxp, char *ln)
+{
+	int len;
+
+	len = strlen(ln);
+
+	/* + 3 for carriage return, newline and null */
+	if (*np + len + 3 > *maxp) {
+		do {
+			*maxp *= 2;
+		} while (*np + len + 3 > *maxp);
+		*sp = erealloc(*sp, sizeof(char) * *maxp);
+	}
+
+	memmove(*sp + *np, ln, len);
+	*np += len;
+	(*sp)[(*np)++] = '\r';
+	(*sp)[(*np)++] = '\n';
+	(*sp)[*np] = '\0';
+}
+
 /* read the raw contents of the current section into a malloc'd string
   * returns a pointer to the string on success, nil on failure */
 static
@@ -291,7 +466,6 @@ readsection(Biobuf *bp)
 {
 	int nchar;
 	int maxchar;
-	int len;
 	char *ln, *section;
 
 	if (bp == nil)
@@ -302,20 +476,7 @@ readsection(Biobuf *bp)
 	section = ecalloc(maxchar, sizeof(char));
 
 	while ((ln = nextdirective(bp)) != nil) {
-		len = strlen(ln);
-
-		/* + 2 for carriage return and newline */
-		if (nchar + len + 2 > maxchar) {
-			do {
-				maxchar *= 2;
-			} while (nchar + len + 2 > maxchar);
-			section = erealloc(section, sizeof(char) * maxchar);
-		}
-
-		strcat(section, ln);
-		strcat(section, "\r\n");
-		nchar += len + 2;
-
+		appendline(&section, &nchar, &maxchar, ln);
 		free(ln);
 	}
 
@@ -367,8 +528,11 @@ csvcountf(char *ln, char *sep)
 	for (p = ln; *p != '\0'; p++) {
 		if (*p == *sep)
 			n++;
-		else if (*p == '"')
+		else if (*p == '"') {
 			p = advquoted(++p, sep);
+			if (*p == '\0')
+				break;
+		}
 	}
 
 	return n+1;
@@ -405,6 +569,9 @@ csvsplit(char *ln, char **fields, int nfields, char *sep)
 		*sepp = '\0';
 		fields[i++] = p;
 
+		if (sepc == '\0')
+			break;
+
 		sepp++;
 		p = sepp + strspn(sepp, sep);
 	} while (sepc == sep[0] && i < nfields);
@@ -412,6 +579,270 @@ csvsplit(char *ln, char **fields, int nfields, char *sep)
 	return i;
 }
 
+/* split ln at each sep in a single pass, doing the work of csvcountf
+  * and csvsplit at once. runs of sep are not collapsed, so the number of
+  * fields always matches csvcountf. the fields are stored in fields if
+  * there are at most nfields of them, or in a malloc'd array otherwise,
+  * which the caller must free. lines with double quotes in them are left
+  * to csvcountf and csvsplit, so quoting works exactly as it does there.
+  * returns the array holding the fields, and stores their number in *np. */
+static
+char **
+csvfields(char *ln, char *sep, char **fields, int nfields, int *np)
+{
+	char **f;
+	char *p;
+	int n, max, i;
+
+	if (ln == nil || sep == nil || fields == nil || np == nil)
+		return nil;
+
+	f = fields;
+	max = nfields;
+	n = 0;
+	for (p = ln;; p++) {
+		if (n == max) {
+			max = (max > 0) ? max * 2 : 8;
+			if (f == fields) {
+				f = ecalloc(max, sizeof(char *));
+				memmove(f, fields, n * sizeof(char *));
+			} else
+				f = erealloc(f, max * sizeof(char *));
+		}
+		f[n++] = p;
+
+		for (; *p != *sep && *p != '\0'; p++)
+			if (*p == '"')
+				goto quoted;
+		if (*p == '\0')
+			break;
+		*p = '\0';
+	}
+
+	*np = n;
+	return f;
+
+quoted:
+	for (i = 1; i < n; i++)
+		f[i][-1] = *sep;
+	if (f != fields)
+		free(f);
+
+	n = csvcountf(ln, sep);
+	f = (n <= nfields) ? fields : ecalloc(n, sizeof(char *));
+	n = csvsplit(ln, f, n, sep);
+
+	*np = n;
+	return f;
+}
+
+/* make tp empty */
+static
+void
+tokinit(linetok *tp)
+{
+	tp->tok = tp->stok;
+	tp->end = tp->send;
+	tp->lvl = tp->slvl;
+	tp->maxtok = NTOKS;
+	tp->ntok = tp->nfield = 0;
+}
+
+/* free the tokens tokline had to allocate, and make tp empty */
+static
+void
+tokfree(linetok *tp)
+{
+	if (tp->tok != tp->stok) {
+		free(tp->tok);
+		free(tp->end);
+		free(tp->lvl);
+	}
+	tokinit(tp);
+}
+
+/* add the token starting at p to tp */
+static
+void
+tokadd(linetok *tp, char *p, int lvl)
+{
+	int max;
+
+	if (tp->ntok == tp->maxtok) {
+		max = tp->maxtok * 2;
+		if (tp->tok == tp->stok) {
+			tp->tok = ecalloc(max, sizeof(char *));
+			tp->end = ecalloc(max, sizeof(char *));
+			tp->lvl = ecalloc(max, sizeof(uchar));
+			memmove(tp->tok, tp->stok, tp->ntok * sizeof(char *));
+			memmove(tp->end, tp->send, tp->ntok * sizeof(char *));
+			memmove(tp->lvl, tp->slvl, tp->ntok * sizeof(uchar));
+		} else {
+			tp->tok = erealloc(tp->tok, max * sizeof(char *));
+			tp->end = erealloc(tp->end, max * sizeof(char *));
+			tp->lvl = erealloc(tp->lvl, max * sizeof(uchar));
+		}
+		tp->maxtok = max;
+	}
+
+	if (lvl == TKFIELD)
+		tp->field[tp->nfield++] = tp->ntok;
+	tp->tok[tp->ntok] = p;
+	tp->lvl[tp->ntok++] = lvl;
+}
+
+/* the TKPIPE, TKCOLON and TKRUNS flags for field f of an object of the given type */
+static
+int
+objseps(int type, int f)
+{
+	switch (type) {
+	case TCIRCLE:
+		return (f == OBJCIRCLEHITSAMP) ? TKCOLON|TKRUNS : 0;
+	case TSLIDER:
+		switch (f) {
+		case OBJCURVES:
+		case OBJEDGESETS:
+			return TKPIPE|TKCOLON;
+		case OBJEDGESOUNDS:
+			return TKPIPE;
+		case OBJSLIDERHITSAMP:
+			return TKCOLON|TKRUNS;
+		}
+		break;
+	case TSPINNER:
+		return (f == OBJSPINNERHITSAMP) ? TKCOLON|TKRUNS : 0;
+	}
+
+	return 0;
+}
+
+/* the slow path of tokline for records with double quotes in them:
+  * split s list by list with csvsplit and csvfields, so quoting works
+  * exactly as it does there. returns the number of fields. */
+static
+int
+tokquoted(char *s, linetok *tp, int nmax, int mode)
+{
+	char *fields[OBJSLIDERHITSAMP+1];
+	char *sitems[NFIELDS], **items;
+	char *sparts[NFIELDS], **parts;
+	int nfields, nitems, nparts;
+	int f, i, j, seps, type;
+
+	if (mode & TKCOMMA)
+		nfields = csvsplit(s, fields, nmax, ",");
+	else {
+		fields[0] = s;
+		nfields = 1;
+	}
+	type = ((mode & TKOBJ) && nfields > OBJTYPE) ? spantol(fields[OBJTYPE], -1) & TBTYPE : 0;
+
+	for (f = 0; f < nfields; f++) {
+		seps = (mode & TKOBJ) ? objseps(type, f) : mode;
+		if (seps & TKPIPE)
+			items = csvfields(fields[f], "|", sitems, nelem(sitems), &nitems);
+		else {
+			items = sitems;
+			items[0] = fields[f];
+			nitems = 1;
+		}
+
+		for (i = 0; i < nitems; i++) {
+			parts = sparts;
+			if (seps & TKRUNS) {
+				if ((nparts = csvsplit(items[i], parts, nelem(sparts), ":")) == 0)
+					parts[nparts++] = items[i];
+			} else if (seps & TKCOLON)
+				parts = csvfields(items[i], ":", sparts, nelem(sparts), &nparts);
+			else {
+				parts[0] = items[i];
+				nparts = 1;
+			}
+
+			for (j = 0; j < nparts; j++)
+				tokadd(tp, parts[j], (j > 0) ? TKPART : (i > 0) ? TKITEM : TKFIELD);
+			if (parts != sparts)
+				free(parts);
+		}
+
+		if (items != sitems)
+			free(items);
+	}
+
+	for (j = 0; j < tp->ntok; j++)
+		tp->end[j] = tp->tok[j] + strlen(tp->tok[j]);
+	tp->field[tp->nfield] = tp->ntok;
+
+	return tp->nfield;
+}
+
+/* split the record s into tp in a single pass over it, finding the
+  * fields, items and parts that mode asks for at once, and null-terminate
+  * each token. like csvsplit, at most nmax fields are split off and the
+  * rest of the line is ignored. the caller must tokfree tp.
+  * returns the number of fields. */
+static
+int
+tokline(char *s, linetok *tp, int nmax, int mode)
+{
+	char *p;
+	int seps, type, k;
+
+	tokinit(tp);
+	if ((mode & TKCOMMA) && *s == '\0')
+		return 0;
+
+	seps = (mode & TKOBJ) ? 0 : mode;
+	type = 0;
+	tokadd(tp, s, TKFIELD);
+
+	for (p = s; *p != '\0'; p++) {
+		switch (*p) {
+		case '"':
+			tokfree(tp);
+			return tokquoted(s, tp, nmax, mode);
+		case ',':
+			if (!(mode & TKCOMMA))
+				break;
+			if ((mode & TKOBJ) && tp->nfield == OBJTYPE+1)
+				type = spantol(tp->tok[tp->ntok-1], p - tp->tok[tp->ntok-1]) & TBTYPE;
+			if (tp->nfield == nmax)
+				goto done;
+			tp->end[tp->ntok-1] = p;
+			while (p[1] == ',')
+				p++;
+			tokadd(tp, p + 1, TKFIELD);
+			if (mode & TKOBJ)
+				seps = objseps(type, tp->nfield-1);
+			break;
+		case '|':
+			if (!(seps & TKPIPE))
+				break;
+			tp->end[tp->ntok-1] = p;
+			tokadd(tp, p + 1, TKITEM);
+			break;
+		case ':':
+			if (!(seps & TKCOLON))
+				break;
+			tp->end[tp->ntok-1] = p;
+			if (seps & TKRUNS)
+				while (p[1] == ':')
+					p++;
+			tokadd(tp, p + 1, TKPART);
+			break;
+		}
+	}
+
+done:
+	tp->end[tp->ntok-1] = p;
+	tp->field[tp->nfield] = tp->ntok;
+	for (k = 0; k < tp->ntok; k++)
+		*tp->end[k] = '\0';
+
+	return tp->nfield;
+}
+
 /* split ln into two distinct fields, delimited by the
   * first instance of any characters in sep. If wstrip is larger than 0, then
   * kvsplit strips whitespace around the delimiter.
@@ -441,59 +872,82 @@ kvsplit(char *ln, char **fields, int nfields, char *sep, int wstrip)
 	return 2;
 }
 
-/* search through an nkvlist-sized kvlist[], and return a pointer
-  * to the first kvdef in kvlist[] whose key value matches k.
-  * returns nil if no matches were found.
-  * lookupkvdef searches case insensitively */
-static
-kvdef *
-lookupkvdef(kvdef *kvlist, int nkvlist, char *k)
-{
-	int i;
-
-	if (k == nil || nkvlist <= 0)
-		return nil;
-
-	for (i = 0; i < nkvlist; i++)
-		if (cistrcmp(kvlist[i].key, k) == 0)
-			return &kvlist[i];
-
-	return nil;
-}
-
 /* create a new entry object from s with the respective .type enum
   * from kvlist. If the key does not appear in kvlist, then the entry's
   * type defaults to TSTRING.
-  * if wstrip is non-zero, strip whitespace around the delimiter
+  * if wstrip is non-zero, strip whitespace around the delimiter.
+  * if sp is non-nil, the entry's key and string value are interned in sp.
   * returns 0 on success, or BADENTRY on failure.
   * this routine sets errstr
   * sample input: 'AudioFilename: audio.mp3' */
 int
-strtoentry(char *s, entry **epp, kvdef *kvlist, int nkvlist, int wstrip)
+strtoentry(arena *arp, strpool *sp, char *s, entry **epp, kvdef *kvlist, int nkvlist, int wstrip)
 {
-	char **fields;
+	char *fields[VALUE+1];
 	entry *ep;
-	kvdef *kvdefp;
-	int type;
+	char *src;
+	int i, type;
 
 	if (s == nil || epp == nil || kvlist == nil || nkvlist <= 0 || wstrip < 0)
 		return BADARGS;
 
-	fields = ecalloc(maxkvfields, sizeof(char *));
-	kvsplit(s, fields, maxkvfields, ":", wstrip);
-	kvdefp = lookupkvdef(kvlist, nkvlist, fields[KEY]);
-	type = (kvdefp != nil) ? kvdefp->type : TSTRING;
+	src = astrdup(arp, s);
+	if (kvsplit(s, fields, maxkvfields, ":", wstrip) < 0) {
+		werrstr("malformed entry definition");
+		goto badentry;
+	}
+	i = kvindex(kvlist, nkvlist, fields[KEY]);
+	type = (i >= 0) ? kvlist[i].type : TSTRING;
 
-	if ((ep = mkentry(fields[KEY], fields[VALUE], type)) == nil) {
+	if ((ep = pmkentry(sp, arp, fields[KEY], fields[VALUE], type)) == nil) {
 		werrstr("malformed entry definition");
-		free(fields);
-		return BADENTRY;
+		goto badentry;
 	}
+	ep->src = src;
 
 	*epp = ep;
-	free(fields);
 
 	return 0;
+
+badentry:
+	afree(arp, src);
+	return BADENTRY;
+}
+
+/* the text of field f of tp, or nil if there is no such field */
+static
+char *
+tokfield(linetok *tp, int f)
+{
+	return (f < tp->nfield) ? tp->tok[tp->field[f]] : nil;
+}
+
+/* the number of parts in the item that starts at token k of tp */
+static
+int
+tokparts(linetok *tp, int k)
+{
+	int n;
+
+	for (n = 1; k + n < tp->ntok && tp->lvl[k + n] == TKPART; n++)
+		;
+
+	return n;
+}
+
+/* the number of items in field f of tp */
+static
+int
+tokitems(linetok *tp, int f)
+{
+	int k, n;
+
+	n = 0;
+	for (k = tp->field[f]; k < tp->field[f+1]; k++)
+		if (tp->lvl[k] != TKPART)
+			n++;
+
+	return n;
 }
 
 /* create a new rgline object from the line definition in s, and assigns it to *lpp.
@@ -501,313 +955,362 @@ strtoentry(char *s, entry **epp, kvdef *kvlist, int nkvlist, int wstrip)
   * this routine sets errstr
   * sample input: '909,465.116279069767,4,1,1,50,1,0' */
 int
-strtoline(char *s, rgline **lpp)
+strtoline(arena *arp, char *s, rgline **lpp)
 {
-	char **fields;
+	linetok tk;
 	int nfields;
 	int effects, type, beats;
 	rgline *lp;
 	double t, vord;
+	char *src;
 
 	if (s == nil || lpp == nil)
 		return BADARGS;
 
-	fields = ecalloc(maxrglinefields, sizeof(char *));
-	nfields = csvsplit(s, fields, maxrglinefields, ",");
+	src = astrdup(arp, s);
+	nfields = tokline(s, &tk, maxrglinefields, TKCOMMA);
 	if (nfields <= LNVOLUME || nfields > LNEFFECTS+1)
 		goto badline;
 
-	t = strtod(fields[LNTIME], nil);
-	vord = strtod(fields[LNVORD], nil);
-	beats = strtod(fields[LNBEATS], nil);
-	type = (nfields > LNTYPE) ? atoi(fields[LNTYPE]) : RLINE;
+	t = spantod(tokfield(&tk, LNTIME), -1);
+	vord = spantod(tokfield(&tk, LNVORD), -1);
+	beats = spantod(tokfield(&tk, LNBEATS), -1);
+	type = (nfields > LNTYPE) ? spantol(tokfield(&tk, LNTYPE), -1) : RLINE;
 
-	if ((lp = mkrgline(t, vord, beats, type)) == nil)
+	if ((lp = amkrgline(arp, t, vord, beats, type)) == nil)
 		goto badline;
+	lp->src = src;
 
-	lp->volume = atoi(fields[LNVOLUME]);
-	lp->sampset = atoi(fields[LNSAMPSET]);
-	lp->sampindex = atoi(fields[LNSAMPINDEX]);
+	lp->volume = spantol(tokfield(&tk, LNVOLUME), -1);
+	lp->sampset = spantol(tokfield(&tk, LNSAMPSET), -1);
+	lp->sampindex = spantol(tokfield(&tk, LNSAMPINDEX), -1);
 
 	if (nfields > LNEFFECTS) {
-		effects = atoi(fields[LNEFFECTS]);
+		effects = spantol(tokfield(&tk, LNEFFECTS), -1);
 		lp->kiai = (effects & EBKIAI) > 0;
 		lp->omitbl = (effects & EBOMIT) > 0;
 		lp->effectbits = effects & ~(EBKIAI | EBOMIT);
 	}
 
+	tokfree(&tk);
 	*lpp = lp;
 
-	free(fields);
-
 	return 0;
 
 badline:
 	werrstr("malformed line definition");
-	free(fields);
+	tokfree(&tk);
+	afree(arp, src);
 	return BADLINE;
 }
 
-/* create new anchors from the list in s, and add them to *alistpp
-  * returns 0 on success, or BADANCHOR on failure.
-  * this routine sets errstr
-  * sample input: 'P|167:115|221:175' */
+/* append the anchors in field f of tp to the *np anchors in *anchorsp.
+  * the anchors are moved into a single new array allocated from arp.
+  * returns the new number of anchors on success, or BADANCHOR on failure.
+  * this routine sets errstr */
+static
 int
-strtoanchlist(char *s, anchor **alistpp)
+tokanchors(arena *arp, linetok *tp, int f, anchor **anchorsp, int *np)
 {
-	char **fields;
-	int nfields;
-	char **afields;
-	int anfields;
-	anchor *ap;
-	int i;
-	int x,y;
-
-	if (s == nil || alistpp == nil)
-		return BADARGS;
-
-	nfields = csvcountf(s, "|");
-	fields = ecalloc(nfields, sizeof(char *));
-	csvsplit(s, fields, nfields, "|");
-
-	/* fields[0] contains curve type */
-	for (i = 1; i < nfields; i++) {
-		if ((anfields = csvcountf(fields[i], ":")) != 2)
+	anchor *new;
+	int k, m, n;
+
+	n = *np;
+	new = aalloc(arp, (n + tokitems(tp, f) - 1) * sizeof(anchor));
+	if (n > 0)
+		memmove(new, *anchorsp, n * sizeof(anchor));
+
+	/* the first item holds the curve type */
+	k = tp->field[f];
+	for (k += tokparts(tp, k); k < tp->field[f+1]; k += m, n++) {
+		if ((m = tokparts(tp, k)) != 2)
 			goto badanchor;
 
-		afields = ecalloc(anfields, sizeof(char *));
-		csvsplit(fields[i], afields, anfields, ":");
-
-		x = atoi(afields[X]);
-		y = atoi(afields[Y]);
-		free(afields);
-
-		if ((ap = mkanch(x, y)) == nil)
-			goto badanchor;
-		*alistpp = addanchn(*alistpp, ap, 0);
+		new[n].x = spantol(tp->tok[k+X], -1);
+		new[n].y = spantol(tp->tok[k+Y], -1);
 	}
 
-	free(fields);
+	afree(arp, *anchorsp);
+	*anchorsp = new;
+	*np = n;
 
-	return i + 1;
+	return n;
 
 badanchor:
-	werrstr("bad anchor definition %s", fields[i]);
-	free(fields);
+	werrstr("bad anchor definition %s", tp->tok[k]);
+	afree(arp, new);
 	return BADANCHOR;
 }
 
-/* create new slider additions from the list in s, and add them to *sladdsp
-  * returns 0 on success.
-  * example input: '4|0|2' */
+/* append the anchors in the list s to the *np anchors in *anchorsp; see tokanchors.
+  * sample input: 'P|167:115|221:175' */
 int
-strtosladds(char *s, int **sladdsp)
+strtoanchlist(arena *arp, char *s, anchor **anchorsp, int *np)
 {
-	char **fields;
-	int *sladds;
-	int nfields;
-	int i;
+	linetok tk;
+	int n;
 
-	if (s == nil || sladdsp == nil)
+	if (s == nil || anchorsp == nil || np == nil)
 		return BADARGS;
 
-	nfields = csvcountf(s, "|");
+	tokline(s, &tk, 1, TKPIPE|TKCOLON);
+	n = tokanchors(arp, &tk, 0, anchorsp, np);
+	tokfree(&tk);
 
-	sladds = ecalloc(nfields, sizeof(int));
-	fields = ecalloc(nfields, sizeof(char *));
-	csvsplit(s, fields, nfields, "|");
+	return n;
+}
+
+/* create new slider additions from the list in field f of tp, and add them to *sladdsp
+  * returns the number of additions. */
+static
+int
+toksladds(arena *arp, linetok *tp, int f, int **sladdsp)
+{
+	int *sladds;
+	int n, i, k;
 
-	for (i = 0; i < nfields; i++)
-		sladds[i] = atoi(fields[i]);
+	n = tokitems(tp, f);
+	sladds = aalloc(arp, n * sizeof(int));
+
+	for (i = 0, k = tp->field[f]; i < n; i++, k += tokparts(tp, k))
+		sladds[i] = spantol(tp->tok[k], -1);
 
 	*sladdsp = sladds;
 
-	free(fields);
+	return n;
+}
+
+/* create new slider additions from the list in s; see toksladds.
+  * example input: '4|0|2' */
+int
+strtosladds(arena *arp, char *s, int **sladdsp)
+{
+	linetok tk;
+	int n;
+
+	if (s == nil || sladdsp == nil)
+		return BADARGS;
+
+	tokline(s, &tk, 1, TKPIPE);
+	n = toksladds(arp, &tk, 0, sladdsp);
+	tokfree(&tk);
 
-	return nfields;
+	return n;
 }
 
-/* create new slider edge samplesets from the list in s, and add them to *slnormsetp
-  * and *sladdsetsp
-  * returns 0 on success, or BADEDGESETS on failure.
-  * this routine sets errstr
-  * sample inputs: '2:0|0:0|1:0', '2|0|1:0' */
+/* create new slider edge samplesets from the list in field f of tp, and add them
+  * to *slnormsetp and *sladdsetsp
+  * returns the number of edge sets on success, or BADEDGESETS on failure.
+  * this routine sets errstr */
+static
 int
-strtoslsets(char *s, int **slnormsetsp, int **sladdsetsp)
+tokslsets(arena *arp, linetok *tp, int f, int **slnormsetsp, int **sladdsetsp)
 {
-	char **fields;
-	int nfields;
-	char **sfields;
-	int snfields;
 	int *slnormsets, *sladdsets;
-	int i;
+	int n, i, k;
 
-	if (s == nil || slnormsetsp == nil || sladdsetsp == nil)
-		return BADARGS;
+	n = tokitems(tp, f);
+	slnormsets = aalloc(arp, n * sizeof(int));
+	sladdsets = aalloc(arp, n * sizeof(int));
 
-	nfields = csvcountf(s, "|");
-	fields = ecalloc(nfields, sizeof(char *));
-	csvsplit(s, fields, nfields, "|");
-	slnormsets = ecalloc(nfields, sizeof(int));
-	sladdsets = ecalloc(nfields, sizeof(int));
-
-	for (i = 0; i < nfields; i++) {
-		snfields = csvcountf(fields[i], ":");
-		if (snfields != SLADDSET+1) {
-			werrstr("malformed edgeset definition %s'", fields[i]);
-			free(fields);
+	for (i = 0, k = tp->field[f]; i < n; i++, k += SLADDSET+1) {
+		if (tokparts(tp, k) != SLADDSET+1) {
+			werrstr("malformed edgeset definition %s'", tp->tok[k]);
+			afree(arp, slnormsets);
+			afree(arp, sladdsets);
 			return BADEDGESETS;
 		}
 
-		sfields = ecalloc(snfields, sizeof(char *));
-		csvsplit(fields[i], sfields, snfields, ":");
-
-		slnormsets[i] = (snfields > SLNORMSET) ? atoi(sfields[SLNORMSET]) : 0;
-		sladdsets[i] = (snfields > SLADDSET) ? atoi(sfields[SLADDSET]) : 0;
-		free(sfields);
+		slnormsets[i] = spantol(tp->tok[k+SLNORMSET], -1);
+		sladdsets[i] = spantol(tp->tok[k+SLADDSET], -1);
 	}
 
 	*slnormsetsp = slnormsets;
 	*sladdsetsp = sladdsets;
 
-	free(fields);
+	return n;
+}
+
+/* create new slider edge samplesets from the list in s; see tokslsets.
+  * sample inputs: '2:0|0:0|1:0', '2|0|1:0' */
+int
+strtoslsets(arena *arp, char *s, int **slnormsetsp, int **sladdsetsp)
+{
+	linetok tk;
+	int n;
+
+	if (s == nil || slnormsetsp == nil || sladdsetsp == nil)
+		return BADARGS;
+
+	tokline(s, &tk, 1, TKPIPE|TKCOLON);
+	n = tokslsets(arp, &tk, 0, slnormsetsp, sladdsetsp);
+	tokfree(&tk);
 
-	return nfields;
+	return n;
 }
 
-/* create a new hitsample from the sample definition in s, and assign it to *hspp
+/* create a new hitsample from the sample definition in field f of tp, and assign it to *hspp.
+  * if pp is non-nil, *hspp is shared through pp instead.
   * returns 0 on success, or BADSAMPLE on failure.
-  * this routine sets errstr
-  * sample input: '0:0:0:0:' */
+  * this routine sets errstr */
+static
 int
-strtohitsamp(char *s, hitsamp **hspp)
+tokhitsamp(arena *arp, samppool *pp, linetok *tp, int f, hitsamp **hspp)
 {
 	char **fields;
 	int nfields;
 	hitsamp *hsp;
 	int normal, addition, index, volume;
-	Rune *file;
+	char *file;
 
-	if (s == nil || hspp == nil)
-		return BADARGS;
-
-	fields = ecalloc(maxhitsampfields, sizeof(char *));
-	nfields = csvsplit(s, fields, maxhitsampfields, ":");
-	if (nfields  < HITSAMPINDEX || nfields > HITSAMPFILE+1)
+	fields = tp->tok + tp->field[f];
+	if ((nfields = tokparts(tp, tp->field[f])) > HITSAMPFILE+1)
+		nfields = HITSAMPFILE+1;
+	if (nfields < HITSAMPINDEX)
 		goto badsamp;
 
-	normal = atoi(fields[HITSAMPNORMAL]);
-	addition = atoi(fields[HITSAMPADDITIONS]);
-	index = (nfields > HITSAMPINDEX) ? atoi(fields[HITSAMPINDEX]) : 0;
-	volume = (nfields > HITSAMPVOLUME) ? atoi(fields[HITSAMPVOLUME]) : 0;
-	file = (nfields > HITSAMPFILE) ? estrrunedup(fields[HITSAMPFILE]) : estrrunedup("");
+	normal = spantol(fields[HITSAMPNORMAL], -1);
+	addition = spantol(fields[HITSAMPADDITIONS], -1);
+	index = (nfields > HITSAMPINDEX) ? spantol(fields[HITSAMPINDEX], -1) : 0;
+	volume = (nfields > HITSAMPVOLUME) ? spantol(fields[HITSAMPVOLUME], -1) : 0;
 
-	if ((hsp = mkhitsamp(normal, addition, index, volume, file)) == nil)
+	if (pp != nil)
+		hsp = asharehitsamp(arp, pp, normal, addition, index, volume, (nfields > HITSAMPFILE) ? fields[HITSAMPFILE] : "");
+	else {
+		file = astrdup(arp, (nfields > HITSAMPFILE) ? fields[HITSAMPFILE] : "");
+		hsp = amkhitsamp(arp, normal, addition, index, volume, file);
+	}
+	if (hsp == nil)
 		goto badsamp;
 
 	*hspp = hsp;
 
-	free(fields);
-
 	return 0;
 
 badsamp:
 	werrstr("malformed hitsample definition");
-	free(fields);
 	return BADSAMPLE;
 }
 
+/* create a new hitsample from the sample definition in s; see tokhitsamp.
+  * sample input: '0:0:0:0:' */
+int
+strtohitsamp(arena *arp, samppool *pp, char *s, hitsamp **hspp)
+{
+	linetok tk;
+	int r;
+
+	if (s == nil || hspp == nil)
+		return BADARGS;
+
+	tokline(s, &tk, 1, TKCOLON|TKRUNS);
+	r = tokhitsamp(arp, pp, &tk, 0, hspp);
+	tokfree(&tk);
+
+	return r;
+}
+
 /* create a new hitobject from the object definition in s, and assign it to *opp
   * returns 0 on success, or BADOBJECT on failure.
   * this routine sets errstr
+  * the whole line, curve and hitsample included, is split by a single tokline
+  * pass; hitsamples are shared through pp if it is non-nil; see tokhitsamp.
   * sample input: '379,41,61838,70,0,P|338:38|305:51,1,70,2|0,2:0|0:0,0:0:0:0:' */
 int
-strtoobj(char *s, hitobject **opp)
+strtoobj(arena *arp, samppool *pp, char *s, hitobject **opp)
 {
-	char **fields;
+	linetok tk;
 	int nfields;
 	hitobject *op;
 	int x, y, typebits, type;
 	double t;
+	char *src;
 
 	if (s == nil || opp == nil)
 		return BADARGS;
 
-	fields = ecalloc(maxobjfields, sizeof(char *));
-	nfields = csvsplit(s, fields, maxobjfields, ",");
+	src = astrdup(arp, s);
+	nfields = tokline(s, &tk, maxobjfields, TKCOMMA|TKOBJ);
 	if (nfields < OBJADDITIONS)
 		goto badobj;
 
-	x = atoi(fields[OBJX]);
-	y = atoi(fields[OBJY]);
-	t = strtod(fields[OBJTIME], nil);
+	x = spantol(tokfield(&tk, OBJX), -1);
+	y = spantol(tokfield(&tk, OBJY), -1);
+	t = spantod(tokfield(&tk, OBJTIME), -1);
 
-	typebits = atoi(fields[OBJTYPE]);
+	typebits = spantol(tokfield(&tk, OBJTYPE), -1);
 	type = typebits & TBTYPE;
 
-	if ((op = mkobj(type, t, x, y)) == nil)
+	if ((op = amkobj(arp, type, t, x, y)) == nil)
 		goto badobj;
+	op->src = src;
 
 	op->typebits = typebits & ~(TBTYPE|TBCOLOR|TBNEWCOMBO|TBHOLD);
 
-	op->additions = atoi(fields[OBJADDITIONS]);
+	op->additions = spantol(tokfield(&tk, OBJADDITIONS), -1);
 	op->newcombo = (typebits & TBNEWCOMBO) > 0;
 	op->comboskip = (typebits & TBCOLOR) >> TBCOLORSHIFT;
 
 	switch (op->type) {
 	case TCIRCLE:
 		if (nfields > OBJCIRCLEHITSAMP)
-			if (strtohitsamp(fields[OBJCIRCLEHITSAMP], &op->hitsamp) < 0)
+			if (tokhitsamp(arp, pp, &tk, OBJCIRCLEHITSAMP, &op->hitsamp) < 0)
 				goto badstr;
 
 		break;
 	case TSLIDER:
-		op->slides = atoi(fields[OBJSLIDES]);
-		op->length = strtod(fields[OBJLENGTH], nil);
+		if (nfields <= OBJCURVES) {
+			werrstr("malformed hitobject definition");
+			goto badstr;
+		}
+		op->slides = spantol(tokfield(&tk, OBJSLIDES), -1);
+		op->length = spantod(tokfield(&tk, OBJLENGTH), -1);
 
-		op->curve = fields[OBJCURVES][0];
-		if (strtoanchlist(fields[OBJCURVES], &op->anchors) < 0)
+		op->curve = tokfield(&tk, OBJCURVES)[0];
+		if (tokanchors(arp, &tk, OBJCURVES, &op->anchors, &op->nanchors) < 0)
 			goto badstr;
+		op->maxanchors = op->nanchors;
 		if (nfields > OBJEDGESOUNDS)
-			if ((op->nsladditions = strtosladds(fields[OBJEDGESOUNDS], &op->sladditions)) < 0)
+			if ((op->nsladditions = toksladds(arp, &tk, OBJEDGESOUNDS, &op->sladditions)) < 0)
 				goto badstr;
 		if (nfields > OBJEDGESETS)
-			if ((op->nslsets = strtoslsets(fields[OBJEDGESETS], &op->slnormalsets, &op->sladditionsets)) < 0)
+			if ((op->nslsets = tokslsets(arp, &tk, OBJEDGESETS, &op->slnormalsets, &op->sladditionsets)) < 0)
 				goto badstr;
 		if (nfields > OBJSLIDERHITSAMP)
-			if (strtohitsamp(fields[OBJSLIDERHITSAMP], &op->hitsamp) < 0)
+			if (tokhitsamp(arp, pp, &tk, OBJSLIDERHITSAMP, &op->hitsamp) < 0)
 				goto badstr;
 
 		break;
 	case TSPINNER:
-		op->spinnerlength = strtod(fields[OBJENDTIME], nil) - t;
+		op->spinnerlength = spantod(tokfield(&tk, OBJENDTIME), -1) - t;
 		if (nfields > OBJSPINNERHITSAMP)
-			if (strtohitsamp(fields[OBJSPINNERHITSAMP], &op->hitsamp) < 0)
+			if (tokhitsamp(arp, pp, &tk, OBJSPINNERHITSAMP, &op->hitsamp) < 0)
 				goto badstr;
 
 		break;
 	default:
 		/* can't happen */
 		werrstr("bad type for object t=%ld: '%b'", op->t, op->type);
-		nukeobj(op);
+		tokfree(&tk);
+		anukeobj(arp, op);
 		return BADOBJECT;
 	}
 
+	tokfree(&tk);
 	*opp = op;
 
-	free(fields);
-
 	return 0;
 
 badstr:
-	/* assume errstr was set by strto* method */
-	free(fields);
-	nukeobj(op);
+	/* assume errstr was set by tok* method */
+	tokfree(&tk);
+	anukeobj(arp, op);
 	return BADOBJECT;
 
 badobj:
 	werrstr("malformed hitobject definition");
-	free(fields);
+	tokfree(&tk);
+	afree(arp, src);
 	return BADOBJECT;
 }
 
@@ -817,334 +1320,1613 @@ mkbeatmap()
 {
 	beatmap *new = ecalloc(1, sizeof(beatmap));
 
-	new->general = mktable(8);
-	new->editor = mktable(8);
-	new->metadata = mktable(8);
-	new->difficulty = mktable(8);
-	new->colours = mktable(8);
+	new->general = mkkvtable(kvgeneral, nkvgeneral);
+	new->editor = mkkvtable(kveditor, nkveditor);
+	new->metadata = mkkvtable(kvmetadata, nkvmetadata);
+	new->difficulty = mkkvtable(kvdifficulty, nkvdifficulty);
+	new->colours = mkkvtable(kvcolours, nkvcolours);
 
 	return new;
 }
 
 /* free a beatmap object, including all hitobjects in bmp->objects,
-  * and rglines in bmp->rglines. */
+  * and rglines in bmp->rglines. if bmp has an arena, its chunks are
+  * released at once without visiting the objects and lines, which must
+  * all come from it (amkobj, amkrgline); what they hold outside of it
+  * is given back through the arena's stragglers. */
 void
 nukebeatmap(beatmap *bmp)
 {
 	rgline *np, *next;
 	hitobject *op, *onext;
 
-	nuketable(bmp->general);
-	nuketable(bmp->editor);
-	nuketable(bmp->metadata);
-	nuketable(bmp->difficulty);
-	nuketable(bmp->colours);
+	anuketable(bmp->arena, bmp->general);
+	anuketable(bmp->arena, bmp->editor);
+	anuketable(bmp->arena, bmp->metadata);
+	anuketable(bmp->arena, bmp->difficulty);
+	anuketable(bmp->arena, bmp->colours);
 
+	free(bmp->version);
+	free(bmp->buf);
 	free(bmp->bookmarks);
 	free(bmp->events);
 
-	for (np = bmp->rglines; np != nil; np = next) {
-		next = np->next;
-		nukergline(np);
-	}
+	if (bmp->arena == nil) {
+		for (np = bmp->rglines; np != nil; np = next) {
+			next = np->next;
+			nukergline(np);
+		}
 
-	for (op = bmp->objects; op != nil; op = onext) {
-		onext = op->next;
-		nukeobj(op);
+		for (op = bmp->objects; op != nil; op = onext) {
+			onext = op->next;
+			nukeobj(op);
+		}
 	}
 
+	nukearena(bmp->arena);
 	free(bmp);
 }
 
-/* read a .osu file from bp, and deserialise all sections into the relevant
-  * bmp structs. this routine calls multiple subroutines that all set the errstr.
+/* deserialise the directive e from section sec into bmp.
+  * [Events] is not handled here; see readsection. hitobjects and lines are
+  * bulk loaded through ldp, and must be sorted with sortobjt and sortrglinet
+  * afterwards.
   * returns 0 on success, negative values on failure. */
+static
 int
-readmap(Biobuf *bp, beatmap *bmp)
+readdirective(beatmap *bmp, loader *ldp, int sec, char *e)
 {
-	char *s, *e;
-	table *tp;
 	entry *ep;
 	rgline *lp;
 	hitobject *op;
-	kvdef *kvlist;
-	int nkvlist;
-	int wstrip;
 	int exit;
 
-	if (bp == nil || bmp == nil)
-		return BADARGS;
+	switch (sec) {
+	case STIMINGPOINTS:
+		if ((exit = strtoline(bmp->arena, e, &lp)) < 0)
+			return exit;
+		bmp->rglines = loadrgline(bmp->rglines, &ldp->ltail, lp);
+		break;
+	case SHITOBJECTS:
+		if ((exit = strtoobj(bmp->arena, bmp->samppool, e, &op)) < 0)
+			return exit;
+		bmp->objects = loadobj(bmp->objects, &ldp->otail, op);
+		break;
+	default:
+		if ((exit = strtoentry(bmp->arena, bmp->pool, e, &ep, sections[sec].kvlist, *sections[sec].nkvlist, sections[sec].wstrip)) < 0)
+			return exit;
+		addentry(sectiontable(bmp, sec), ep);
+		break;
+	}
+
+	return 0;
+}
 
-	bmp->version = nextline(bp);
+/* deserialise the [TimingPoints] or [HitObjects] lines between p and ep
+  * into bmp on bmp->nproc procs with splitlines, and bulk load them through
+  * ldp in file order, so that the lists come out just like readdirective's.
+  * returns 0 on success, negative values on failure. */
+static
+int
+loadlines(beatmap *bmp, loader *ldp, int sec, char *p, char *ep)
+{
+	void **v;
+	int nv, i, exit;
 
-	while ((s = nextsection(bp)) != nil) {
-		if (strcmp(s, "[TimingPoints]") == 0) {
-			while ((e = nextdirective(bp)) != nil) {
-				if ((exit = strtoline(e, &lp)) < 0)
-					return exit;
-				bmp->rglines = addrglinet(bmp->rglines, lp);
-				free(e);
-			}
+	v = nil;
+	exit = splitlines(bmp->arena, bmp->samppool, sec, p, ep, bmp->nproc, &v, &nv);
+	if (v == nil)
+		return exit;
 
-			free(s);
-			continue;
-		} else if (strcmp(s, "[HitObjects]") == 0) {
-			while ((e = nextdirective(bp)) != nil) {
-				if ((exit = strtoobj(e, &op)) < 0)
-					return exit;
-				bmp->objects = addobjt(bmp->objects, op);
-				free(e);
-			}
+	for (i = 0; i < nv; i++)
+		if (sec == SHITOBJECTS)
+			bmp->objects = loadobj(bmp->objects, &ldp->otail, v[i]);
+		else
+			bmp->rglines = loadrgline(bmp->rglines, &ldp->ltail, v[i]);
+	free(v);
 
-			free(s);
-			continue;
-		}
+	return exit;
+}
 
-		if (strcmp(s, "[Events]") == 0) {
-			bmp->events = readsection(bp);
-			free(s);
-			continue;
-		}
+/* deserialise the lines of section sec from sp into bmp, up to the next
+  * section header or the end of sp. the header that ended the section
+  * is stored in *hp, or nil at the end of sp.
+  * returns 0 on success, negative values on failure. */
+static
+int
+scansection(beatmap *bmp, loader *ldp, int sec, scanner *sp, char **hp)
+{
+	char *e, *p, *nl, *le;
+	int nchar, maxchar;
+	int exit;
 
-		wstrip = 1;
-		if (strcmp(s, "[General]") == 0) {
-			tp =  bmp->general;
-			kvlist = kvgeneral;
-			nkvlist = nkvgeneral;
-		} else if (strcmp(s, "[Editor]") == 0) {
-			tp =  bmp->editor;
-			kvlist = kveditor;
-			nkvlist = nkveditor;
-		} else if (strcmp(s, "[Metadata]") == 0) {
-			tp =  bmp->metadata;
-			kvlist = kvmetadata;
-			nkvlist = nkvmetadata;
-			wstrip = 0;
-		} else if (strcmp(s, "[Difficulty]") == 0) {
-			tp =  bmp->difficulty;
-			kvlist = kvdifficulty;
-			nkvlist = nkvdifficulty;
-		} else if (strcmp(s, "[Colours]") == 0) {
-			tp =  bmp->colours;
-			kvlist = kvcolours;
-			nkvlist = nkvcolours;
-		} else {
-			werrstr("bad section %s", s);
-			free(s);
-			return BADSECTION;
+	if (bmp->nproc > 1 && splitlines != nil && (sec == STIMINGPOINTS || sec == SHITOBJECTS)) {
+		/* find the next header, and hand everything up to it to loadlines */
+		for (p = sp->p; p < sp->ep; p = nl + 1) {
+			if ((nl = memchr(p, '\n', sp->ep - p)) == nil)
+				nl = sp->ep;
+			le = (nl > p && nl[-1] == '\r') ? nl - 1 : nl;
+			if (le > p && p[0] == '[' && le[-1] == ']')
+				break;
 		}
+		if (p > sp->ep)
+			p = sp->ep;
 
-		while ((e = nextdirective(bp)) != nil) {
-			if ((exit = strtoentry(e, &ep, kvlist, nkvlist, wstrip)) < 0)
-				return exit;
-			addentry(tp, ep);
-			free(e);
-		}
+		exit = loadlines(bmp, ldp, sec, sp->p, p);
+		sp->p = p;
+		*hp = scanline(sp);
 
-		free(s);
+		return exit;
+	}
+
+	if (sec == SEVENTS) {
+		free(bmp->events);
+		nchar = 0;
+		maxchar = 256;
+		bmp->events = ecalloc(maxchar, sizeof(char));
+	}
+
+	while ((e = scanline(sp)) != nil && isheader(e) != 1) {
+		if (isempty(e) == 1)
+			continue;
+
+		if (sec == SEVENTS)
+			appendline(&bmp->events, &nchar, &maxchar, e);
+		else if ((exit = readdirective(bmp, ldp, sec, e)) < 0)
+			return exit;
 	}
 
+	*hp = e;
+
 	return 0;
 }
 
-/* first write all tp entries listed in kvlist to bp, before writing
-  * all remaining entries that do not appear in kvlist. writeentries
-  * assumes that all entries not in kvlist have the type TSTRING.
-  * returns 0 on success, negative values on failure */
+/* create a reader that pulls events from bp with nextevent.
+  * the reader does not own bp. */
+mapreader *
+mkreader(Biobuf *bp)
+{
+	mapreader *new;
+
+	if (bp == nil)
+		return nil;
+
+	new = ecalloc(1, sizeof(mapreader));
+	new->bp = bp;
+	new->sec = -1;
+	new->scratch = mkarena(0);
+
+	return new;
+}
+
+/* create a reader over the n bytes of .osu data in buf. like readmapbuf,
+  * lines are null-terminated inside buf itself. */
+mapreader *
+mkreaderbuf(char *buf, long n)
+{
+	mapreader *new;
+
+	if (buf == nil || n < 0)
+		return nil;
+
+	new = ecalloc(1, sizeof(mapreader));
+	new->p = buf;
+	new->ep = buf + n;
+	new->sec = -1;
+	new->scratch = mkarena(0);
+
+	return new;
+}
+
+/* free rp and its scratch storage, along with the records of the last event */
+void
+nukereader(mapreader *rp)
+{
+	if (rp == nil)
+		return;
+
+	free(rp->ln);
+	nukearena(rp->scratch);
+	free(rp);
+}
+
+/* return the next line of rp with the trailing carriage return stripped,
+  * or nil at end-of-file. lines are null-terminated in place, in the
+  * Biobuf's buffer or the caller's; only lines that do not fit there
+  * are copied into rp->ln. */
 static
-int
-writeentries(Biobuf *bp, table *tp, kvdef *kvlist, int nkvlist)
+char *
+readerline(mapreader *rp)
 {
-	entry **written;
-	entry *ep;
-	int i, n, found;
+	char *ln, *nl;
+	long n;
 
-	if (tp == nil || bp == nil || kvlist == nil || nkvlist < 0)
-		return BADARGS;
+	free(rp->ln);
+	rp->ln = nil;
 
-	written = ecalloc(tp->nentry, sizeof(entry *));
-	for (i = 0, n = 0; i < nkvlist; i++) {
-		ep = lookupentry(tp, kvlist[i].key);
-		if (ep != nil) {
-			Bprint(bp, "\r\n");
-			switch(ep->type) {
-			case TRUNE:
-				Bprint(bp, kvlist[i].fmt, kvlist[i].key, ep->S);
-				break;
-			case TSTRING:
-				Bprint(bp, kvlist[i].fmt, kvlist[i].key, ep->s);
-				break;
-			case TINT:
-				Bprint(bp, kvlist[i].fmt, kvlist[i].key, ep->i);
-				break;
-			case TLONG:
-				Bprint(bp, kvlist[i].fmt, kvlist[i].key, ep->l);
-				break;
-			case TFLOAT:
-				Bprint(bp, kvlist[i].fmt, kvlist[i].key, ep->f);
-				break;
-			case TDOUBLE:
-				Bprint(bp, kvlist[i].fmt, kvlist[i].key, ep->d);
-				break;
-			}
-			written[n++] = ep;
+	if (rp->bp == nil) {
+		if (rp->p >= rp->ep)
+			return nil;
+		ln = rp->p;
+		if ((nl = memchr(ln, '\n', rp->ep - ln)) != nil) {
+			n = nl - ln;
+			rp->p = nl + 1;
+		} else {
+			n = rp->ep - ln;
+			rp->ln = ecalloc(n + 1, sizeof(char));
+			memmove(rp->ln, ln, n);
+			ln = rp->ln;
+			rp->p = rp->ep;
 		}
+	} else if ((ln = Brdline(rp->bp, '\n')) != nil) {
+		n = Blinelen(rp->bp) - 1;
+	} else {
+		/* longer than the buffer, or unterminated at end-of-file */
+		if (Blinelen(rp->bp) <= 0 || (rp->ln = Brdstr(rp->bp, '\n', 1)) == nil)
+			return nil;
+		ln = rp->ln;
+		n = strlen(ln);
 	}
 
-	if (n == tp->nentry) {
-		free(written);
-		return 0;
+	ln[n] = '\0';
+	if (n > 0 && ln[n-1] == '\r')
+		ln[n-1] = '\0';
+	rp->nline++;
+
+	return ln;
+}
+
+/* pull the next event from rp into ev. empty lines and lines before the
+  * first section header are skipped. the records in ev are allocated from
+  * rp->scratch, and only live until the next call, so a steady stream of
+  * events does not allocate at all; if rp->keep is set, they are allocated
+  * from rp->arena instead, and belong to the caller.
+  * this routine calls multiple subroutines that all set the errstr.
+  * returns the event type, EVEOF at end-of-file, or negative values on failure. */
+int
+nextevent(mapreader *rp, mapevent *ev)
+{
+	arena *arp;
+	char *ln;
+	int sec;
+	int exit;
+
+	if (rp == nil || ev == nil)
+		return BADARGS;
+
+	memset(ev, 0, sizeof(mapevent));
+	if (rp->keep)
+		arp = rp->arena;
+	else {
+		areset(rp->scratch);
+		arp = rp->scratch;
 	}
 
-	ep = nil;
-	while ((ep = nextentry(tp, ep)) != nil) {
-		found = 0;
-		for (i = 0; i < n; i++) {
-			if (written[i] == ep) {
-				found = 1;
-				break;
+	while ((ln = readerline(rp)) != nil) {
+		ev->sec = rp->sec;
+		ev->text = ln;
+
+		if (rp->nline == 1)
+			return ev->type = EVVERSION;
+
+		if (isheader(ln) == 1) {
+			if ((rp->sec = lookupsection(ln)) < 0) {
+				werrstr("bad section %s", ln);
+				return BADSECTION;
 			}
+			ev->sec = rp->sec;
+			return ev->type = EVSECTION;
 		}
-		if (found == 0) {
-			if (ep->type != TSTRING) {
-				werrstr("unknown key %s does not have type TSTRING");
-				free(written);
-				return BADENTRY;
-			}
-			Bprint(bp, "\r\n%s: %s", ep->key, ep->s);
+
+		if ((sec = rp->sec) < 0 || isempty(ln) == 1)
+			continue;
+
+		switch (sec) {
+		case SEVENTS:
+			return ev->type = EVTEXT;
+		case STIMINGPOINTS:
+			if ((exit = strtoline(arp, ln, &ev->line)) < 0)
+				return exit;
+			return ev->type = EVLINE;
+		case SHITOBJECTS:
+			if ((exit = strtoobj(arp, rp->keep ? rp->samppool : nil, ln, &ev->obj)) < 0)
+				return exit;
+			return ev->type = EVOBJECT;
+		default:
+			if ((exit = strtoentry(arp, rp->keep ? rp->pool : nil, ln, &ev->entry, sections[sec].kvlist, *sections[sec].nkvlist, sections[sec].wstrip)) < 0)
+				return exit;
+			return ev->type = EVENTRY;
 		}
 	}
 
-	free(written);
-	return 0;
+	ev->text = nil;
+	return ev->type = EVEOF;
 }
 
-/* write all rglines from lines to bp
-  * returns 0 on success, -1 on failure */
-static
+/* read a .osu file from bp, and deserialise all sections into the relevant
+  * bmp structs, as events pulled from a mapreader.
+  * this routine calls multiple subroutines that all set the errstr.
+  * returns 0 on success, negative values on failure. */
 int
-writerglines(Biobuf *bp, rgline *lines)
+readmap(Biobuf *bp, beatmap *bmp)
 {
-	rgline *np;
-	double vord;
-	int effects;
+	mapreader *rp;
+	mapevent ev;
+	loader ld;
+	char *e;
+	int nchar, maxchar;
+	int exit;
 
-	if (bp == nil || lines == nil)
+	if (bp == nil || bmp == nil)
 		return BADARGS;
 
-	for (np = lines; np != nil; np = np->next) {
-		vord = (np->type == GLINE) ? np->velocity : np->duration;
-		effects = np->effectbits;
-		effects = (np->kiai > 0) ? effects | EBKIAI : effects & ~EBKIAI;
-		effects = (np->omitbl > 0) ? effects | EBOMIT : effects & ~EBOMIT;
+	memset(&ld, 0, sizeof(ld));
+	nchar = maxchar = 0;
 
-		Bprint(bp, "\r\n%.16G,%.16G,%d,%d,%d,%d,%d,%d", np->t, vord, np->beats, np->sampset, np->sampindex, np->volume, np->type, effects);
+	rp = mkreader(bp);
+	rp->keep = 1;
+	rp->arena = bmp->arena;
+	rp->pool = bmp->pool;
+	rp->samppool = bmp->samppool;
+
+	while ((exit = nextevent(rp, &ev)) > 0) {
+		switch (ev.type) {
+		case EVVERSION:
+			bmp->version = estrdup(ev.text);
+			break;
+		case EVSECTION:
+			if (ev.sec == SEVENTS) {
+				free(bmp->events);
+				nchar = 0;
+				maxchar = 256;
+				bmp->events = ecalloc(maxchar, sizeof(char));
+			} else if (bmp->nproc > 1 && splitlines != nil && (ev.sec == STIMINGPOINTS || ev.sec == SHITOBJECTS)) {
+				/* hand the whole section to loadlines; the reader picks up at the next header */
+				e = readsection(bp);
+				exit = loadlines(bmp, &ld, ev.sec, e, e + strlen(e));
+				free(e);
+			}
+			break;
+		case EVTEXT:
+			appendline(&bmp->events, &nchar, &maxchar, ev.text);
+			break;
+		case EVENTRY:
+			addentry(sectiontable(bmp, ev.sec), ev.entry);
+			break;
+		case EVLINE:
+			bmp->rglines = loadrgline(bmp->rglines, &ld.ltail, ev.line);
+			break;
+		case EVOBJECT:
+			bmp->objects = loadobj(bmp->objects, &ld.otail, ev.obj);
+			break;
+		}
+		if (exit < 0)
+			break;
 	}
 
-	return 0;
+	nukereader(rp);
+	bmp->rglines = sortrglinet(bmp->rglines);
+	bmp->objects = sortobjt(bmp->objects);
+
+	return exit;
 }
 
-/* write all hitobjects from objects to bp
-  * returns 0 on success, -1 on failure */
-static
+/* deserialise the n bytes of .osu data in buf into bmp, like readmap.
+  * buf is scanned in place: lines and fields are null-terminated inside
+  * buf itself, so no line is ever copied onto the heap. buf is owned
+  * by the caller and may be discarded once readmapbuf returns.
+  * a buffer without a version line or section headers is rejected.
+  * this routine sets errstr
+  * returns 0 on success, negative values on failure. */
 int
-writehitobjects(Biobuf *bp, hitobject *objects)
+readmapbuf(char *buf, long n, beatmap *bmp)
 {
-	int i;
-	hitobject *np;
-	anchor *ap;
-	int typebits;
+	scanner sc;
+	loader ld;
+	char *s;
+	int sec;
+	int exit;
 
-	if (bp == nil || objects == nil)
+	if (buf == nil || n < 0 || bmp == nil)
 		return BADARGS;
 
-	for (np = objects; np != nil; np = np->next) {
-		Bprint(bp, "\r\n");
-		typebits = np->typebits | np->type | (np->comboskip << TBCOLORSHIFT);
-		if (np->newcombo > 0)
-			typebits |= TBNEWCOMBO;
+	sc.p = buf;
+	sc.ep = buf + n;
+	sc.last = nil;
+	memset(&ld, 0, sizeof(ld));
 
-		Bprint(bp, "%d,%d,%.16G,%d,%d", np->anchors->x, np->anchors->y, np->t, typebits, np->additions);
+	if ((s = scanline(&sc)) == nil) {
+		werrstr("no version line");
+		return BADSECTION;
+	}
+	bmp->version = estrdup(s);
+
+	while ((s = scanline(&sc)) != nil && isheader(s) != 1)
+		;
+	if (s == nil) {
+		free(sc.last);
+		werrstr("no sections");
+		return BADSECTION;
+	}
 
-		switch(np->type) {
-		case TCIRCLE:
+	exit = 0;
+	while (s != nil) {
+		if ((sec = lookupsection(s)) < 0) {
+			werrstr("bad section %s", s);
+			exit = BADSECTION;
 			break;
-		case TSLIDER:
-			Bprint(bp, ",%c", np->curve);
-			for (ap = np->anchors->next; ap != nil; ap = ap->next)
-				Bprint(bp, "|%d:%d", ap->x, ap->y);
+		}
 
-			Bprint(bp, ",%d,%.16G", np->slides, np->length);
+		if ((exit = scansection(bmp, &ld, sec, &sc, &s)) < 0)
+			break;
+	}
 
-			if (np->sladditions != nil) {
-				Bprint(bp, ",%d", np->sladditions[0]);
-				for (i = 1; i < np->nsladditions; i++)
-					Bprint(bp, "|%d", np->sladditions[i]);
-			}
+	free(sc.last);
+	bmp->rglines = sortrglinet(bmp->rglines);
+	bmp->objects = sortobjt(bmp->objects);
 
-			if (np->slnormalsets != nil && np->sladditionsets != nil) {
-				Bprint(bp, ",%d:%d", np->slnormalsets[0], np->sladditionsets[0]);
-				for (i = 1; i < np->nslsets; i++)
-					Bprint(bp, "|%d:%d", np->slnormalsets[i], np->sladditionsets[i]);
-			}
+	return exit;
+}
 
+/* read fd until end-of-file into a malloc'd buffer, and store the number
+  * of bytes read in *np. the buffer is null-terminated. the size dirfstat
+  * reports is only a hint: pipes, and other files whose length reads as 0
+  * or goes stale, are read by growing the buffer.
+  * returns the buffer, or nil on failure. */
+static
+char *
+readall(int fd, long *np)
+{
+	Dir *d;
+	char *buf;
+	long n, m, max;
+
+	max = 0;
+	if ((d = dirfstat(fd)) != nil) {
+		max = d->length;
+		free(d);
+	}
+	/* one spare byte, so that end-of-file is seen without growing */
+	max = (max + 1 > 8192) ? max + 1 : 8192;
+	buf = ecalloc(max + 1, sizeof(char));
+
+	for (n = 0;; n += m) {
+		if (n == max) {
+			max *= 2;
+			buf = erealloc(buf, max + 1);
+		}
+		if ((m = read(fd, buf + n, max - n)) < 0) {
+			free(buf);
+			return nil;
+		}
+		if (m == 0)
 			break;
-		case TSPINNER:
-			Bprint(bp, ",%.11G", np->t + np->spinnerlength);
+	}
+	buf[n] = '\0';
+	*np = n;
 
-			break;
+	return buf;
+}
+
+/* read the .osu file open on fd into memory until end of file, with
+  * readall, and deserialise it into bmp with readmapbuf.
+  * this routine sets errstr
+  * returns 0 on success, negative values on failure. */
+int
+readmapfd(int fd, beatmap *bmp)
+{
+	char *buf;
+	long n;
+	int exit;
+
+	if (fd < 0 || bmp == nil)
+		return BADARGS;
+
+	if ((buf = readall(fd, &n)) == nil)
+		return BADARGS;
+
+	exit = readmapbuf(buf, n, bmp);
+	free(buf);
+
+	return exit;
+}
+
+/* index the n bytes of .osu data in buf into bmp without deserialising
+  * anything but the version header: the text of each section is recorded
+  * in bmp->raw, and parsed by loadsection on first access. sections
+  * that are never loaded are written back by writemap unchanged.
+  * buf is owned by the caller, and must outlive bmp; loadsection
+  * modifies the parts of it that it deserialises.
+  * this routine sets errstr
+  * returns 0 on success, negative values on failure. */
+int
+openmapbuf(char *buf, long n, beatmap *bmp)
+{
+	char *p, *ep, *nl, *le, *end;
+	char *hdr;
+	int sec, i;
+
+	if (buf == nil || n < 0 || bmp == nil)
+		return BADARGS;
+
+	hdr = nil;
+	sec = -1;
+	end = nil;
+	for (p = buf, ep = buf + n; p < ep; p = nl + 1) {
+		if ((nl = memchr(p, '\n', ep - p)) == nil)
+			nl = ep;
+		le = (nl > p && nl[-1] == '\r') ? nl - 1 : nl;
+
+		if (p == buf) {
+			bmp->version = ecalloc(le - p + 1, sizeof(char));
+			memmove(bmp->version, p, le - p);
+			continue;
 		}
 
-		if (np->hitsamp != nil) {
-			Bprint(bp, ",%d:%d:%d", np->hitsamp->normal, np->hitsamp->addition, np->hitsamp->index);
-			Bprint(bp, ":%d:%S", np->hitsamp->volume, np->hitsamp->file);
+		if (le - p > 1 && p[0] == '[' && le[-1] == ']') {
+			if (hdr != nil)
+				bmp->raw[sec] = (span){hdr, end - hdr};
+
+			for (sec = -1, i = 0; i < NSECTION; i++)
+				if (strlen(sections[i].header) == le - p && memcmp(p, sections[i].header, le - p) == 0)
+					sec = i;
+
+			if (sec < 0) {
+				werrstr("bad section %.*s", (int)(le - p), p);
+				return BADSECTION;
+			} else if (bmp->raw[sec].p != nil) {
+				werrstr("duplicate section %s", sections[sec].header);
+				return BADSECTION;
+			}
+
+			hdr = p;
+			end = le;
+			continue;
 		}
+
+		for (i = 0; p + i < le; i++)
+			if (p[i] != '\r' && p[i] != '\t' && p[i] != ' ')
+				break;
+		if (p + i < le)
+			end = le;
 	}
 
+	if (hdr != nil)
+		bmp->raw[sec] = (span){hdr, end - hdr};
+
 	return 0;
 }
 
-/* write all sections to bp */
+/* read the entire .osu file open on fd into bmp->buf, and index it
+  * with openmapbuf.
+  * this routine sets errstr
+  * returns 0 on success, negative values on failure. */
 int
-writemap(Biobuf *bp, beatmap *bmp)
+openmapfd(int fd, beatmap *bmp)
 {
-	if (bp == nil || bmp == nil)
+	long n;
+
+	if (fd < 0 || bmp == nil || bmp->buf != nil)
 		return BADARGS;
 
-	Bprint(bp, "%s\r\n", bmp->version);
+	if ((bmp->buf = readall(fd, &n)) == nil)
+		return BADARGS;
 
-	if (bmp->general->nentry > 0) {
-		Bprint(bp, "\r\n[General]");
-		writeentries(bp, bmp->general, kvgeneral, nkvgeneral);
-	}
-	 if (bmp->editor->nentry > 0) {
-		Bprint(bp, "\r\n\r\n[Editor]");
-		writeentries(bp, bmp->editor, kveditor, nkveditor);
-	}
-	if (bmp->metadata->nentry > 0) {
-		Bprint(bp, "\r\n\r\n[Metadata]");
-		writeentries(bp, bmp->metadata, kvmetadata, nkvmetadata);
-	}
-	if (bmp->difficulty->nentry > 0) {
-		Bprint(bp, "\r\n\r\n[Difficulty]");
-		writeentries(bp, bmp->difficulty, kvdifficulty, nkvdifficulty);
-	}
-	if (bmp->events != nil) {
-		Bprint(bp, "\r\n\r\n[Events]");
-		Bprint(bp, "\r\n%s", bmp->events);
-	}
-	if (bmp->rglines != nil) {
-		Bprint(bp, "\r\n[TimingPoints]");
-		writerglines(bp, bmp->rglines);
-	}
-	if (bmp->colours->nentry > 0) {
-		Bprint(bp, "\r\n\r\n[Colours]");
-		writeentries(bp, bmp->colours, kvcolours, nkvcolours);
-	}
-	if (bmp->objects != nil) {
-		Bprint(bp, "\r\n\r\n[HitObjects]");
-		writehitobjects(bp, bmp->objects);
-	}
+	return openmapbuf(bmp->buf, n, bmp);
+}
+
+/* deserialise section sec of a lazily opened bmp, if it has not been
+  * deserialised already. must be called before accessing the tables
+  * or lists of a section in a map opened with openmapbuf.
+  * returns 0 on success, negative values on failure. */
+int
+loadsection(beatmap *bmp, int sec)
+{
+	scanner sc;
+	loader ld;
+	char *s;
+	int exit;
+
+	if (bmp == nil || sec < 0 || sec >= NSECTION)
+		return BADARGS;
+
+	if (bmp->raw[sec].p == nil)
+		return 0;
+
+	sc.p = bmp->raw[sec].p;
+	sc.ep = sc.p + bmp->raw[sec].n;
+	sc.last = nil;
+	memset(&ld, 0, sizeof(ld));
+	bmp->raw[sec].p = nil;
+
+	scanline(&sc);
+	exit = scansection(bmp, &ld, sec, &sc, &s);
+	free(sc.last);
+
+	if (sec == STIMINGPOINTS)
+		bmp->rglines = sortrglinet(bmp->rglines);
+	else if (sec == SHITOBJECTS)
+		bmp->objects = sortobjt(bmp->objects);
+
+	return exit;
+}
+
+/* deserialise every section of a lazily opened bmp that has
+  * not been deserialised already.
+  * returns 0 on success, negative values on failure. */
+int
+loadmap(beatmap *bmp)
+{
+	int i, exit;
+
+	if (bmp == nil)
+		return BADARGS;
+
+	for (i = 0; i < NSECTION; i++)
+		if ((exit = loadsection(bmp, i)) < 0)
+			return exit;
 
 	return 0;
 }
+
+/* order shift ranges by their start */
+static
+int
+tshiftcmp(void *a, void *b)
+{
+	tshift *x, *y;
+
+	x = a;
+	y = b;
+	if (x->from < y->from)
+		return -1;
+	return x->from > y->from;
+}
+
+/* returns t moved by the delta of the range in sv it falls in.
+  * the n ranges in sv are sorted and disjoint. */
+static
+double
+shiftt(tshift *sv, int n, double t)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = n;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (sv[mid].to <= t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < n && sv[lo].from <= t)
+		return t + sv[lo].delta;
+
+	return t;
+}
+
+/* shift the integer time in the n bytes at p, and write it to buf.
+  * returns the length of the new time, or -1 if p is not a time. */
+static
+int
+shiftfield(char *buf, char *p, long n, tshift *sv, int nshift)
+{
+	long i;
+
+	for (i = (n > 0 && p[0] == '-'); i < n; i++)
+		if (p[i] < '0' || p[i] > '9')
+			return -1;
+	if (n == 0 || (n == 1 && p[0] == '-'))
+		return -1;
+
+	return ltostr(buf, floor(shiftt(sv, nshift, spantol(p, n)) + 0.5));
+}
+
+/* return a copy of the comma-separated list of times in s in arena arp,
+  * with every time shifted. other fields are copied as they are. */
+static
+char *
+shiftlist(arena *arp, char *s, tshift *sv, int nshift)
+{
+	char *new, *q, *p, *e;
+	int n;
+
+	for (n = 1, p = s; *p != '\0'; p++)
+		n += (*p == ',');
+	new = aalloc(arp, strlen(s) + n*24 + 1);
+
+	q = new;
+	for (p = s;; p = e + 1) {
+		if ((e = strchr(p, ',')) == nil)
+			e = p + strlen(p);
+		if ((n = shiftfield(q, p, e - p, sv, nshift)) < 0) {
+			memmove(q, p, e - p);
+			n = e - p;
+		}
+		q += n;
+		if (*e == '\0')
+			break;
+		*q++ = ',';
+	}
+	*q = '\0';
+
+	return new;
+}
+
+/* append [Events] line ln to *sp like appendline, with its absolute times
+  * shifted: the start of videos, samples and legacy background colour
+  * changes, the bounds of breaks, and the times of storyboard commands. commands nested in loops and triggers are
+  * relative to them, and are left alone. */
+static
+void
+shiftevent(char *ln, tshift *sv, int nshift, char **sp, int *np, int *maxp)
+{
+	char *out, *q, *p, *e;
+	int depth, first, last, i, n;
+
+	depth = strspn(ln, " _");
+	p = ln + depth;
+	first = last = 0;
+	if (depth == 0) {
+		if (strncmp(p, "2,", 2) == 0 || strncmp(p, "Break,", 6) == 0) {
+			first = 1;
+			last = 2;
+		} else if (strncmp(p, "1,", 2) == 0 || strncmp(p, "Video,", 6) == 0
+		|| strncmp(p, "3,", 2) == 0 || strncmp(p, "Colour,", 7) == 0
+		|| strncmp(p, "5,", 2) == 0 || strncmp(p, "Sample,", 7) == 0)
+			first = last = 1;
+	} else if (depth == 1) {
+		if (strncmp(p, "L,", 2) == 0)
+			first = last = 1;
+		else {
+			first = 2;
+			last = 3;
+		}
+	}
+
+	if (first == 0) {
+		appendline(sp, np, maxp, ln);
+		return;
+	}
+
+	out = ecalloc(strlen(ln) + 2*24 + 1, sizeof(char));
+	memmove(out, ln, depth);
+	q = out + depth;
+	for (i = 0;; i++, p = e + 1) {
+		if ((e = strchr(p, ',')) == nil)
+			e = p + strlen(p);
+		if (i < first || i > last || (n = shiftfield(q, p, e - p, sv, nshift)) < 0) {
+			memmove(q, p, e - p);
+			n = e - p;
+		}
+		q += n;
+		if (*e == '\0')
+			break;
+		*q++ = ',';
+	}
+	*q = '\0';
+
+	appendline(sp, np, maxp, out);
+	free(out);
+}
+
+/* move everything in bmp that falls in one of the nshift ranges in sv
+  * by that range's delta: hitobjects and spinner ends, timing points,
+  * PreviewTime, bookmarks, and the times in [Events]. all of it is
+  * done in a single pass over each list. the lists stay in order, unless
+  * a range is moved past its neighbours, in which case they are sorted
+  * once afterwards. a spinner whose end would come before its start
+  * keeps its length.
+  * this routine sets errstr
+  * returns 0 on success, negative values on failure. */
+int
+shiftmap(beatmap *bmp, tshift *sv, int nshift)
+{
+	tshift *v;
+	hitobject *op, *oprev;
+	rgline *lp, *lprev;
+	entry *ep;
+	char *s, *ln, *e;
+	double t, end;
+	long preview;
+	int i, exit, nchar, maxchar, osort, lsort;
+	static struct {
+		int sec;
+		char *key;
+	} lists[] = {
+		{SGENERAL, "EditorBookmarks"},
+		{SEDITOR, "Bookmarks"},
+	};
+
+	if (bmp == nil || sv == nil || nshift < 0)
+		return BADARGS;
+
+	v = ecalloc(nshift + 1, sizeof(tshift));
+	memmove(v, sv, nshift * sizeof(tshift));
+	qsort(v, nshift, sizeof(tshift), tshiftcmp);
+	for (i = 0; i < nshift; i++) {
+		if (v[i].from >= v[i].to || (i > 0 && v[i].from < v[i-1].to)) {
+			werrstr("bad shift range %g-%g", v[i].from, v[i].to);
+			free(v);
+			return BADARGS;
+		}
+	}
+
+	if ((exit = loadmap(bmp)) < 0) {
+		free(v);
+		return exit;
+	}
+
+	osort = 0;
+	for (oprev = nil, op = bmp->objects; op != nil; oprev = op, op = op->next) {
+		t = shiftt(v, nshift, op->t);
+		if (op->type == TSPINNER) {
+			end = shiftt(v, nshift, op->t + op->spinnerlength) - t;
+			/* an end that would come before the start moves with it */
+			if (end < 0)
+				end = op->spinnerlength;
+			if (end != op->spinnerlength) {
+				op->spinnerlength = end;
+				op->moved = 1;
+			}
+		}
+		if (t != op->t) {
+			op->t = t;
+			op->moved = 1;
+		}
+		if (oprev != nil && op->t < oprev->t)
+			osort = 1;
+	}
+
+	lsort = 0;
+	for (lprev = nil, lp = bmp->rglines; lp != nil; lprev = lp, lp = lp->next) {
+		t = shiftt(v, nshift, lp->t);
+		if (t != lp->t) {
+			lp->t = t;
+			lp->moved = 1;
+		}
+		if (lprev != nil && (lp->t < lprev->t || (lp->t == lprev->t && lp->type == RLINE && lprev->type == GLINE)))
+			lsort = 1;
+	}
+
+	if (osort)
+		bmp->objects = sortobjt(bmp->objects);
+	if (lsort)
+		bmp->rglines = sortrglinet(bmp->rglines);
+
+	/* entries are only touched if their value changes, so that the
+	  * rest are still written back as they were read */
+	if ((ep = lookupentry(bmp->general, "PreviewTime")) != nil && ep->type == TLONG && ep->l >= 0) {
+		preview = floor(shiftt(v, nshift, ep->l) + 0.5);
+		if (preview != ep->l) {
+			ep->l = preview;
+			ep->dirty = 1;
+		}
+	}
+
+	for (i = 0; i < nelem(lists); i++) {
+		if ((ep = lookupentry(sectiontable(bmp, lists[i].sec), lists[i].key)) == nil || ep->type != TSTRING)
+			continue;
+		s = shiftlist(bmp->arena, ep->s, v, nshift);
+		if (strcmp(s, ep->s) != 0)
+			asetentrys(bmp->arena, ep, s);
+		else
+			afree(bmp->arena, s);
+	}
+
+	if (bmp->events != nil) {
+		s = bmp->events;
+		nchar = 0;
+		maxchar = strlen(s) + 256;
+		bmp->events = ecalloc(maxchar, sizeof(char));
+		for (ln = s; *ln != '\0'; ln = e) {
+			if ((e = strstr(ln, "\r\n")) != nil) {
+				*e = '\0';
+				e += 2;
+			} else
+				e = ln + strlen(ln);
+			shiftevent(ln, v, nshift, &bmp->events, &nchar, &maxchar);
+		}
+		free(s);
+	}
+
+	free(v);
+
+	return 0;
+}
+
+/* store value v of the field ik in mip */
+static
+void
+setmapinfo(mapinfo *mip, infokey *ik, char *v)
+{
+	switch (ik->bit) {
+	case MIMODE:
+		mip->mode = spantol(v, -1);
+		break;
+	case MITITLE:
+		utfecpy(mip->title, mip->title + MISTRLEN, v);
+		break;
+	case MIARTIST:
+		utfecpy(mip->artist, mip->artist + MISTRLEN, v);
+		break;
+	case MICREATOR:
+		utfecpy(mip->creator, mip->creator + MISTRLEN, v);
+		break;
+	case MIVERSION:
+		utfecpy(mip->version, mip->version + MISTRLEN, v);
+		break;
+	case MIBEATMAPID:
+		mip->beatmapid = spantol(v, -1);
+		break;
+	case MIBEATMAPSETID:
+		mip->beatmapsetid = spantol(v, -1);
+		break;
+	case MIHP:
+		mip->hp = spantod(v, -1);
+		break;
+	case MICS:
+		mip->cs = spantod(v, -1);
+		break;
+	case MIOD:
+		mip->od = spantod(v, -1);
+		break;
+	case MIAR:
+		mip->ar = spantod(v, -1);
+		break;
+	}
+
+	mip->found |= ik->bit;
+}
+
+/* read the key-value sections of the .osu file in bp until all fields in
+  * the bitmask want (see enum mapinfobits) have been found, or until the
+  * first section after [Difficulty] starts, and store them in mip. lines
+  * are read in place with Brdline; only an overlong or unterminated line
+  * is copied, with Brdstr. bp is left wherever scanning stopped. fields that were not found are zero;
+  * mip->found tells them apart.
+  * returns 0 on success, negative values on failure. */
+int
+scanmapinfo(Biobuf *bp, int want, mapinfo *mip)
+{
+	char *ln, *copy, *fields[VALUE+1];
+	int sec, len, i;
+
+	if (bp == nil || mip == nil)
+		return BADARGS;
+
+	memset(mip, 0, sizeof(mapinfo));
+	want &= MIALL;
+	sec = -1;
+	copy = nil;
+
+	while ((mip->found & want) != want) {
+		free(copy);
+		copy = nil;
+		if ((ln = Brdline(bp, '\n')) != nil)
+			len = Blinelen(bp) - 1;
+		else {
+			/* longer than the buffer, or unterminated at end-of-file */
+			if (Blinelen(bp) <= 0 || (copy = Brdstr(bp, '\n', 1)) == nil)
+				break;
+			ln = copy;
+			len = strlen(ln);
+		}
+
+		if (len > 0 && ln[len-1] == '\r')
+			len--;
+		ln[len] = '\0';
+
+		if (isheader(ln) == 1) {
+			/* every key scanmapinfo knows comes before [Events] */
+			if ((sec = lookupsection(ln)) > SDIFFICULTY)
+				break;
+			continue;
+		}
+
+		if (sec != SGENERAL && sec != SMETADATA && sec != SDIFFICULTY)
+			continue;
+		if (isempty(ln) == 1 || kvsplit(ln, fields, VALUE+1, ":", sections[sec].wstrip) < 0)
+			continue;
+
+		for (i = 0; i < nelem(infokeys); i++) {
+			if (infokeys[i].sec == sec && (want & infokeys[i].bit) && cistrcmp(infokeys[i].key, fields[KEY]) == 0) {
+				setmapinfo(mip, &infokeys[i], fields[VALUE]);
+				break;
+			}
+		}
+	}
+	free(copy);
+
+	return 0;
+}
+
+/* write ep to f, formatted by kvp, or as a TSTRING if kvp is nil.
+  * returns 0 on success, or BADENTRY if ep can not be formatted */
+static
+int
+writeentry(Fmt *f, entry *ep, kvdef *kvp)
+{
+	if (ep->src != nil && ep->dirty == 0) {
+		fmtprint(f, "\r\n%s", ep->src);
+		return 0;
+	}
+
+	if (kvp == nil) {
+		if (ep->type != TSTRING) {
+			werrstr("unknown key %s does not have type TSTRING", ep->key);
+			return BADENTRY;
+		}
+		fmtprint(f, "\r\n%s: %s", ep->key, ep->s);
+		return 0;
+	}
+
+	fmtprint(f, "\r\n");
+	switch(ep->type) {
+	case TRUNE:
+	case TSTRING:
+		fmtprint(f, kvp->fmt, kvp->key, ep->s);
+		break;
+	case TINT:
+		fmtprint(f, kvp->fmt, kvp->key, ep->i);
+		break;
+	case TLONG:
+		fmtprint(f, kvp->fmt, kvp->key, ep->l);
+		break;
+	case TFLOAT:
+		fmtprint(f, kvp->fmt, kvp->key, ep->f);
+		break;
+	case TDOUBLE:
+		fmtprint(f, kvp->fmt, kvp->key, ep->d);
+		break;
+	}
+
+	return 0;
+}
+
+/* write the tp entries whose keys are in tp->kvlist to f in kvlist
+  * order, followed by all remaining entries in the order they were
+  * added. entries whose keys are not in tp->kvlist must have the
+  * type TSTRING.
+  * returns 0 on success, negative values on failure */
+static
+int
+writeentries(Fmt *f, table *tp)
+{
+	tabiter it;
+	entry *ep;
+	int i, n;
+
+	if (tp == nil || f == nil)
+		return BADARGS;
+
+	for (i = 0; i < tp->nkvlist; i++)
+		if ((ep = tp->known[i]) != nil && (n = writeentry(f, ep, &tp->kvlist[i])) < 0)
+			return n;
+
+	/* unknown keys, and known keys that were overridden by a later entry */
+	inittabiter(&it, tp);
+	while ((ep = tabnext(&it)) != nil) {
+		i = kvindex(tp->kvlist, tp->nkvlist, ep->key);
+		if (i >= 0 && tp->known[i] == ep)
+			continue;
+		if ((n = writeentry(f, ep, (i >= 0) ? &tp->kvlist[i] : nil)) < 0)
+			return n;
+	}
+
+	return 0;
+}
+
+/* write the n bytes at s to f, flushing it as often as needed.
+  * returns 0 on success, -1 if f could not be flushed */
+static
+int
+putbytes(Fmt *f, char *s, long n)
+{
+	long m;
+
+	while (n > 0) {
+		if ((char *)f->to >= (char *)f->stop && f->flush(f) == 0)
+			return -1;
+		m = (char *)f->stop - (char *)f->to;
+		if (m > n)
+			m = n;
+		memmove(f->to, s, m);
+		f->to = (char *)f->to + m;
+		f->nfmt += m;
+		s += m;
+		n -= m;
+	}
+
+	return 0;
+}
+
+/* write the character c to f */
+static
+int
+putch(Fmt *f, int c)
+{
+	char b;
+
+	b = c;
+	return putbytes(f, &b, 1);
+}
+
+/* write v to f in decimal, followed by the character sep unless it is negative */
+static
+void
+putint(Fmt *f, vlong v, int sep)
+{
+	char buf[24];
+	int n;
+
+	n = ltostr(buf, v);
+	if (sep >= 0)
+		buf[n++] = sep;
+	putbytes(f, buf, n);
+}
+
+/* write v to f like "%.precG", followed by the character sep unless it is negative */
+static
+void
+putdbl(Fmt *f, double v, int prec, int sep)
+{
+	char buf[32+1];
+	int n;
+
+	n = dtostr(buf, v, prec);
+	if (sep >= 0)
+		buf[n++] = sep;
+	putbytes(f, buf, n);
+}
+
+/* write s to f up to and including its nth comma, and return
+  * what follows; the end of s if it has fewer commas */
+static
+char *
+putto(Fmt *f, char *s, int n)
+{
+	char *p;
+
+	for (p = s; n > 0 && (p = strchr(p, ',')) != nil; n--)
+		p++;
+	if (p == nil)
+		p = s + strlen(s);
+	putbytes(f, s, p - s);
+
+	return p;
+}
+
+/* write all rglines from lines to f
+  * returns 0 on success, -1 on failure */
+static
+int
+writerglines(Fmt *f, rgline *lines)
+{
+	rgline *np;
+	double vord;
+	char *p;
+	int effects;
+
+	if (f == nil || lines == nil)
+		return BADARGS;
+
+	for (np = lines; np != nil; np = np->next) {
+		if (np->src != nil && np->dirty == 0 && np->moved == 0) {
+			putbytes(f, "\r\n", 2);
+			putbytes(f, np->src, strlen(np->src));
+			continue;
+		}
+		if (np->src != nil && np->dirty == 0) {
+			/* patch the new time into src, leaving the rest as it was read */
+			putbytes(f, "\r\n", 2);
+			putdbl(f, np->t, 16, -1);
+			p = np->src + strcspn(np->src, ",");
+			putbytes(f, p, strlen(p));
+			continue;
+		}
+
+		vord = (np->type == GLINE) ? np->velocity : np->duration;
+		effects = np->effectbits;
+		effects = (np->kiai > 0) ? effects | EBKIAI : effects & ~EBKIAI;
+		effects = (np->omitbl > 0) ? effects | EBOMIT : effects & ~EBOMIT;
+
+		/* "\r\n%.16G,%.16G,%d,%d,%d,%d,%d,%d" */
+		putbytes(f, "\r\n", 2);
+		putdbl(f, np->t, 16, ',');
+		putdbl(f, vord, 16, ',');
+		putint(f, np->beats, ',');
+		putint(f, np->sampset, ',');
+		putint(f, np->sampindex, ',');
+		putint(f, np->volume, ',');
+		putint(f, np->type, ',');
+		putint(f, effects, -1);
+	}
+
+	return 0;
+}
+
+/* write object op to f
+  * returns 0 on success, -1 on failure */
+static
+int
+writeobj(Fmt *f, hitobject *op)
+{
+	char *p;
+	int i;
+	int typebits;
+
+	if (f == nil || op == nil || op->nanchors < 1)
+		return BADARGS;
+
+	if (op->src != nil && op->dirty == 0 && op->moved == 0) {
+		putbytes(f, "\r\n", 2);
+		putbytes(f, op->src, strlen(op->src));
+		return 0;
+	}
+	if (op->src != nil && op->dirty == 0) {
+		/* patch the new time, and a spinner's end, into src */
+		putbytes(f, "\r\n", 2);
+		p = putto(f, op->src, OBJTIME);
+		putdbl(f, op->t, 16, -1);
+		p += strcspn(p, ",");
+		if (op->type == TSPINNER) {
+			p = putto(f, p, OBJENDTIME - OBJTIME);
+			putdbl(f, op->t + op->spinnerlength, 11, -1);
+			p += strcspn(p, ",");
+		}
+		putbytes(f, p, strlen(p));
+		return 0;
+	}
+
+	typebits = op->typebits | op->type | (op->comboskip << TBCOLORSHIFT);
+	if (op->newcombo > 0)
+		typebits |= TBNEWCOMBO;
+
+	/* "\r\n%d,%d,%.16G,%d,%d" */
+	putbytes(f, "\r\n", 2);
+	putint(f, op->anchors[0].x, ',');
+	putint(f, op->anchors[0].y, ',');
+	putdbl(f, op->t, 16, ',');
+	putint(f, typebits, ',');
+	putint(f, op->additions, -1);
+
+	switch(op->type) {
+	case TCIRCLE:
+		break;
+	case TSLIDER:
+		putch(f, ',');
+		putch(f, op->curve);
+		for (i = 1; i < op->nanchors; i++) {
+			putch(f, '|');
+			putint(f, op->anchors[i].x, ':');
+			putint(f, op->anchors[i].y, -1);
+		}
+
+		putch(f, ',');
+		putint(f, op->slides, ',');
+		putdbl(f, op->length, 16, -1);
+
+		if (op->sladditions != nil) {
+			putch(f, ',');
+			putint(f, op->sladditions[0], -1);
+			for (i = 1; i < op->nsladditions; i++) {
+				putch(f, '|');
+				putint(f, op->sladditions[i], -1);
+			}
+		}
+
+		if (op->slnormalsets != nil && op->sladditionsets != nil) {
+			putch(f, ',');
+			putint(f, op->slnormalsets[0], ':');
+			putint(f, op->sladditionsets[0], -1);
+			for (i = 1; i < op->nslsets; i++) {
+				putch(f, '|');
+				putint(f, op->slnormalsets[i], ':');
+				putint(f, op->sladditionsets[i], -1);
+			}
+		}
+
+		break;
+	case TSPINNER:
+		putch(f, ',');
+		putdbl(f, op->t + op->spinnerlength, 11, -1);
+
+		break;
+	}
+
+	if (op->hitsamp != nil) {
+		putch(f, ',');
+		putint(f, op->hitsamp->normal, ':');
+		putint(f, op->hitsamp->addition, ':');
+		putint(f, op->hitsamp->index, ':');
+		putint(f, op->hitsamp->volume, ':');
+		if (op->hitsamp->file != nil)
+			putbytes(f, op->hitsamp->file, strlen(op->hitsamp->file));
+	}
+
+	return 0;
+}
+
+/* write all hitobjects from objects to f
+  * returns 0 on success, -1 on failure */
+static
+int
+writehitobjects(Fmt *f, hitobject *objects)
+{
+	hitobject *np;
+	int exit;
+
+	if (f == nil || objects == nil)
+		return BADARGS;
+
+	for (np = objects; np != nil; np = np->next)
+		if ((exit = writeobj(f, np)) < 0)
+			return exit;
+
+	return 0;
+}
+
+/* write sep, followed by the unparsed text of a section in rp
+  * returns 0 on success, -1 on failure */
+static
+int
+writeraw(Fmt *f, span *rp, char *sep)
+{
+	if (f == nil || rp == nil || rp->p == nil)
+		return BADARGS;
+
+	fmtprint(f, "%s", sep);
+	putbytes(f, rp->p, rp->n);
+
+	return 0;
+}
+
+/* write all sections but [HitObjects] to f. sections of a lazily
+  * opened map that have not been loaded are copied through from bmp->raw. */
+static
+int
+writeheader(Fmt *f, beatmap *bmp)
+{
+	if (f == nil || bmp == nil)
+		return BADARGS;
+
+	fmtprint(f, "%s\r\n", bmp->version);
+
+	if (bmp->raw[SGENERAL].p != nil) {
+		writeraw(f, &bmp->raw[SGENERAL], "\r\n");
+	} else if (bmp->general->nentry > 0) {
+		fmtprint(f, "\r\n[General]");
+		writeentries(f, bmp->general);
+	}
+	if (bmp->raw[SEDITOR].p != nil) {
+		writeraw(f, &bmp->raw[SEDITOR], "\r\n\r\n");
+	} else if (bmp->editor->nentry > 0) {
+		fmtprint(f, "\r\n\r\n[Editor]");
+		writeentries(f, bmp->editor);
+	}
+	if (bmp->raw[SMETADATA].p != nil) {
+		writeraw(f, &bmp->raw[SMETADATA], "\r\n\r\n");
+	} else if (bmp->metadata->nentry > 0) {
+		fmtprint(f, "\r\n\r\n[Metadata]");
+		writeentries(f, bmp->metadata);
+	}
+	if (bmp->raw[SDIFFICULTY].p != nil) {
+		writeraw(f, &bmp->raw[SDIFFICULTY], "\r\n\r\n");
+	} else if (bmp->difficulty->nentry > 0) {
+		fmtprint(f, "\r\n\r\n[Difficulty]");
+		writeentries(f, bmp->difficulty);
+	}
+	if (bmp->raw[SEVENTS].p != nil) {
+		writeraw(f, &bmp->raw[SEVENTS], "\r\n\r\n");
+		fmtprint(f, "\r\n");
+	} else if (bmp->events != nil) {
+		fmtprint(f, "\r\n\r\n[Events]");
+		fmtprint(f, "\r\n%s", bmp->events);
+	}
+	if (bmp->raw[STIMINGPOINTS].p != nil) {
+		writeraw(f, &bmp->raw[STIMINGPOINTS], "\r\n");
+	} else if (bmp->rglines != nil) {
+		fmtprint(f, "\r\n[TimingPoints]");
+		writerglines(f, bmp->rglines);
+	}
+	if (bmp->raw[SCOLOURS].p != nil) {
+		writeraw(f, &bmp->raw[SCOLOURS], "\r\n\r\n");
+	} else if (bmp->colours->nentry > 0) {
+		fmtprint(f, "\r\n\r\n[Colours]");
+		writeentries(f, bmp->colours);
+	}
+
+	return 0;
+}
+
+/* write all sections to f, like writeheader followed by [HitObjects] */
+static
+int
+writemapfmt(Fmt *f, beatmap *bmp)
+{
+	int exit;
+
+	if ((exit = writeheader(f, bmp)) < 0)
+		return exit;
+	if (bmp->raw[SHITOBJECTS].p != nil) {
+		writeraw(f, &bmp->raw[SHITOBJECTS], "\r\n\r\n");
+	} else if (bmp->objects != nil) {
+		fmtprint(f, "\r\n\r\n[HitObjects]");
+		writehitobjects(f, bmp->objects);
+	}
+
+	return 0;
+}
+
+/* serialise bmp into bp.
+  * returns 0 on success, negative values on failure. */
+int
+writemap(Biobuf *bp, beatmap *bmp)
+{
+	Fmt f;
+	int exit;
+
+	if (bp == nil || bmp == nil)
+		return BADARGS;
+
+	if (Bfmtinit(&f, bp) < 0)
+		return BADARGS;
+	exit = writemapfmt(&f, bmp);
+	if (Bfmtflush(&f) < 0)
+		return BADARGS;
+
+	return exit;
+}
+
+/* a rough upper bound of the size of bmp once serialised */
+static
+long
+mapsize(beatmap *bmp)
+{
+	hitobject *op;
+	rgline *lp;
+	long n;
+	int i;
+
+	n = 4096;
+	if (bmp->events != nil)
+		n += strlen(bmp->events);
+	for (i = 0; i < NSECTION; i++)
+		n += bmp->raw[i].n;
+	for (lp = bmp->rglines; lp != nil; lp = lp->next)
+		n += 64;
+	for (op = bmp->objects; op != nil; op = op->next)
+		n += (op->type == TSLIDER) ? 128 : 48;
+
+	return n;
+}
+
+/* Fmt flush routine for writemapbuf: double the size of the buffer */
+static
+int
+growflush(Fmt *f)
+{
+	long n, size;
+	char *buf;
+
+	n = (char *)f->to - (char *)f->start;
+	size = 2 * ((char *)f->stop - (char *)f->start + 1);
+	buf = erealloc(f->start, size);
+
+	f->start = buf;
+	f->to = buf + n;
+	f->stop = buf + size - 1;
+
+	return 1;
+}
+
+/* serialise bmp into memory, like writemap. *bufp is either nil, or
+  * a malloc'd buffer of *sizep bytes; if it is nil, a buffer is
+  * allocated that is large enough for most maps. the buffer is grown
+  * with realloc as needed, and its final address and size are stored
+  * back in *bufp and *sizep. the serialised map is null-terminated,
+  * and its length is stored in *np.
+  * returns 0 on success, negative values on failure. */
+int
+writemapbuf(beatmap *bmp, char **bufp, long *sizep, long *np)
+{
+	Fmt f;
+	int exit;
+
+	if (bmp == nil || bufp == nil || sizep == nil || np == nil)
+		return BADARGS;
+
+	if (*bufp == nil || *sizep < 2) {
+		free(*bufp);
+		*sizep = mapsize(bmp);
+		*bufp = ecalloc(*sizep, sizeof(char));
+	}
+
+	/* fmtstrinit sets up every field of f on both Plan 9 and p9p;
+	  * its small buffer is then swapped for *bufp */
+	if (fmtstrinit(&f) < 0)
+		sysfatal("out of memory\n");
+	free(f.start);
+	f.start = f.to = *bufp;
+	f.stop = *bufp + *sizep - 1;	/* room for the null */
+	f.flush = growflush;
+	f.farg = nil;
+
+	exit = writemapfmt(&f, bmp);
+
+	*bufp = f.start;
+	*sizep = (char *)f.stop - (char *)f.start + 1;
+	*np = (char *)f.to - (char *)f.start;
+	(*bufp)[*np] = '\0';
+
+	return exit;
+}
+
+/* start streaming a map to bp: write every section of bmp but
+  * [HitObjects], whose objects are then passed to putobj one at a
+  * time, and finished off with endmap. bmp->objects is ignored,
+  * and bmp must stay around until endmap.
+  * returns a new mapwriter, or nil on failure. */
+mapwriter *
+startmap(Biobuf *bp, beatmap *bmp)
+{
+	mapwriter *wp;
+
+	if (bp == nil || bmp == nil)
+		return nil;
+
+	wp = ecalloc(1, sizeof(mapwriter));
+	if (Bfmtinit(&wp->f, bp) < 0) {
+		free(wp);
+		return nil;
+	}
+	wp->lastt = -1e300;
+
+	if (writeheader(&wp->f, bmp) < 0) {
+		Bfmtflush(&wp->f);
+		free(wp);
+		return nil;
+	}
+	fmtprint(&wp->f, "\r\n\r\n[HitObjects]");
+
+	return wp;
+}
+
+/* write op to the map being streamed by wp. objects must be passed in
+  * time order; op is not kept, so the caller may reuse or free it.
+  * this routine sets errstr
+  * returns 0 on success, negative values on failure. */
+int
+putobj(mapwriter *wp, hitobject *op)
+{
+	if (wp == nil || op == nil)
+		return BADARGS;
+
+	if (op->t < wp->lastt) {
+		werrstr("object t=%.16G precedes t=%.16G", op->t, wp->lastt);
+		return BADOBJECT;
+	}
+	wp->lastt = op->t;
+	wp->nobj++;
+
+	return writeobj(&wp->f, op);
+}
+
+/* flush the map streamed by wp, and free wp.
+  * returns the number of objects written, or negative values on failure. */
+long
+endmap(mapwriter *wp)
+{
+	long n;
+
+	if (wp == nil)
+		return BADARGS;
+
+	n = (Bfmtflush(&wp->f) < 0) ? BADARGS : wp->nobj;
+	free(wp);
+
+	return n;
+}
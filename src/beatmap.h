@@ -1,7 +1,33 @@
 /* osu! beatmap types & parsing/manipulation functions */
+
+/* sections, in the order writemap emits them */
+enum {
+	SGENERAL=0,
+	SEDITOR,
+	SMETADATA,
+	SDIFFICULTY,
+	SEVENTS,
+	STIMINGPOINTS,
+	SCOLOURS,
+	SHITOBJECTS,
+	NSECTION,
+} sectiontypes;
+
+/* a run of n bytes starting at p; not null-terminated */
+typedef struct span {
+	char *p;
+	long n;
+} span;
+
 typedef struct beatmap {
 	char *version;		/* version header */
 
+	/* entries, lines and objects read from a file are written back from
+	  * their src until modified.  change them through the setters
+	  * (moveobjt, ixmoveobj, moverglinet and shiftmap patch only the time;
+	  * setobjxy, setobjcombo, addobjanch, edithitsamp and asetentrys mark
+	  * them dirty), or call dirtyobj, dirtyrgline or dirtyentry after
+	  * writing a field directly, or the change is lost on write */
 	table *general;		/* [General] */
 	table *editor;		/* [Editor] */
 	long *bookmarks;	/* bookmark list */
@@ -14,14 +40,97 @@ typedef struct beatmap {
 
 	/* [HitObjects] */
 	hitobject *objects;	/* head of object list */
+
+	arena *arena;		/* optional; if non-nil, readmap allocates everything it parses from here,
+					  * and objects and lines added later must come from here too; see nukebeatmap */
+	strpool *pool;		/* optional; if non-nil, entry keys and string values are interned here */
+	samppool *samppool;	/* optional; if non-nil, objects with identical hitsamples share them through it */
+	int nproc;		/* procs used to parse large [TimingPoints] and [HitObjects] sections; needs splitlines */
+
+	/* lazily opened maps; see openmapbuf */
+	char *buf;			/* file contents read by openmapfd */
+	span raw[NSECTION];	/* unparsed section text, header included; raw[i].p is nil once parsed */
 } beatmap;
 
-/* key-value pair definition */
-typedef struct kvdef {
-	char *key;		/* string key of entry */
-	char *fmt;		/* format string for output */
-	int type;		/* the data type of the associated value. see hash.h:2,9 */
-} kvdef;
+/* header fields gathered by scanmapinfo; bits for mapinfo.found */
+enum {
+	MIMODE = 1<<0,			/* [General] Mode */
+	MITITLE = 1<<1,			/* [Metadata] Title */
+	MIARTIST = 1<<2,			/* [Metadata] Artist */
+	MICREATOR = 1<<3,		/* [Metadata] Creator */
+	MIVERSION = 1<<4,		/* [Metadata] Version */
+	MIBEATMAPID = 1<<5,		/* [Metadata] BeatmapID */
+	MIBEATMAPSETID = 1<<6,	/* [Metadata] BeatmapSetID */
+	MIHP = 1<<7,				/* [Difficulty] HPDrainRate */
+	MICS = 1<<8,				/* [Difficulty] CircleSize */
+	MIOD = 1<<9,				/* [Difficulty] OverallDifficulty */
+	MIAR = 1<<10,			/* [Difficulty] ApproachRate */
+	MIALL = (1<<11) - 1,
+	MISTRLEN = 128,			/* size of string fields, null included; longer values are truncated */
+} mapinfobits;
+
+typedef struct mapinfo {
+	int found;				/* MI* bits of the fields that were found */
+	int mode;
+	int beatmapid;
+	int beatmapsetid;
+	char title[MISTRLEN];
+	char artist[MISTRLEN];
+	char creator[MISTRLEN];
+	char version[MISTRLEN];
+	float hp, cs, od, ar;
+} mapinfo;
+
+/* state of a map being streamed by startmap, putobj and endmap */
+typedef struct mapwriter {
+	Fmt f;			/* formats into the Biobuf passed to startmap */
+	double lastt;		/* time of the last object written */
+	long nobj;			/* number of objects written */
+} mapwriter;
+
+/* events returned by nextevent */
+enum {
+	EVEOF=0,		/* end of input */
+	EVVERSION,		/* the version header; text */
+	EVSECTION,		/* a section header; sec and text */
+	EVENTRY,		/* a key-value pair; entry */
+	EVLINE,		/* a timing point; line */
+	EVOBJECT,		/* a hitobject; obj */
+	EVTEXT,		/* a raw [Events] line; text */
+} eventtypes;
+
+/* a single event pulled from a mapreader. text always points into the
+  * reader's line buffer; see nextevent for the lifetime of the records. */
+typedef struct mapevent {
+	int type;			/* EV* */
+	int sec;			/* section the event belongs to */
+	char *text;
+	entry *entry;
+	rgline *line;
+	hitobject *obj;
+} mapevent;
+
+/* state of a map being read event by event; see mkreader */
+typedef struct mapreader {
+	Biobuf *bp;		/* input, or nil when reading from a buffer */
+	char *p;			/* start of the next unread line in the buffer */
+	char *ep;			/* end of the buffer */
+	char *ln;			/* malloc'd copy of an overlong or unterminated line */
+	long nline;		/* lines read so far */
+	int sec;			/* current section, or -1 before the first header */
+	int keep;			/* if set, records come from arena and belong to the caller */
+	arena *arena;		/* used when keep is set; nil for the heap */
+	arena *scratch;	/* records of the last event; reset by every nextevent */
+	strpool *pool;		/* used when keep is set; entry strings are interned here if non-nil */
+	samppool *samppool;	/* used when keep is set; hitsamples are shared through it if non-nil */
+} mapreader;
+
+/* a time range, and the offset shiftmap applies to everything in it */
+typedef struct tshift {
+	double from;		/* start of the range in ms */
+	double to;			/* end of the range, not included; may be Inf(1) */
+	double delta;		/* offset in ms */
+} tshift;
 
 extern kvdef kvgeneral[];
 extern kvdef kveditor[];
@@ -35,18 +144,41 @@ extern int nkvmetadata;
 extern int nkvdifficulty;
 extern int nkvcolours;
 
-int strtoentry(char *s, entry **epp, kvdef *kvlist, int nkvlist, int wstrip);
-int strtoline(char *s, rgline **lpp);
-int strtoanchlist(char *s, anchor **alistpp);
-int strtosladds(char *s, int **sladdsp);
-int strtoslsets(char *s, int **slnormsetsp, int **sladdsetsp);
-int strtohitsamp(char *s, hitsamp **hspp);
-int strtoobj(char *s, hitobject **opp);
+/* parses the [TimingPoints] or [HitObjects] lines between p and ep on up to
+  * nproc procs. nil by default, so readmap never needs libthread; batch.c
+  * installs readlines here with initsplit */
+extern int (*splitlines)(arena *arp, samppool *pp, int sec, char *p, char *ep, int nproc, void ***vp, int *nvp);
+
+/* the strto* routines allocate from arp, or from the heap if arp is nil.
+  * the new entry, line or object keeps a copy of s in its src field */
+int strtoentry(arena *arp, strpool *sp, char *s, entry **epp, kvdef *kvlist, int nkvlist, int wstrip);
+int strtoline(arena *arp, char *s, rgline **lpp);
+int strtoanchlist(arena *arp, char *s, anchor **anchorsp, int *np);
+int strtosladds(arena *arp, char *s, int **sladdsp);
+int strtoslsets(arena *arp, char *s, int **slnormsetsp, int **sladdsetsp);
+int strtohitsamp(arena *arp, samppool *pp, char *s, hitsamp **hspp);
+int strtoobj(arena *arp, samppool *pp, char *s, hitobject **opp);
 
 beatmap *mkbeatmap();
 void nukebeatmap(beatmap *bmp);
 int readmap(Biobuf *bp, beatmap *bmp);
+int readmapbuf(char *buf, long n, beatmap *bmp);
+int readmapfd(int fd, beatmap *bmp);
+int openmapbuf(char *buf, long n, beatmap *bmp);
+int openmapfd(int fd, beatmap *bmp);
+int loadsection(beatmap *bmp, int sec);
+int loadmap(beatmap *bmp);
+int shiftmap(beatmap *bmp, tshift *sv, int nshift);
+int scanmapinfo(Biobuf *bp, int want, mapinfo *mip);
 int writemap(Biobuf *bp, beatmap *bmp);
+int writemapbuf(beatmap *bmp, char **bufp, long *sizep, long *np);
+mapwriter *startmap(Biobuf *bp, beatmap *bmp);
+int putobj(mapwriter *wp, hitobject *op);
+long endmap(mapwriter *wp);
+mapreader *mkreader(Biobuf *bp);
+mapreader *mkreaderbuf(char *buf, long n);
+void nukereader(mapreader *rp);
+int nextevent(mapreader *rp, mapevent *ev);
 
 enum {
 	BADARGS=-1,
@@ -1,83 +1,386 @@
 #include <u.h>
 #include <libc.h>
 #include "aux.h"
+#include "arena.h"
 #include "hash.h"
 
-/* create a new table with a hash size of n */
+enum {
+	KVMULT = 31,		/* first multiplier tried for a kvhash */
+	KVMAXSLOT = 1<<12,	/* give up on a kvhash beyond this many slots */
+	MAXKVHASH = 16,		/* number of kvdef arrays that can be hashed */
+};
+
+/* perfect hash over the keys of a kvdef array: every key hashes to a
+  * slot of its own, which holds its index in kvlist */
+typedef struct kvhash {
+	kvdef *kvlist;
+	int nkvlist;
+	uint mult;		/* multiplier that gives no collisions */
+	uint mask;		/* number of slots - 1 */
+	short *slot;		/* kvlist index for each slot, or -1 */
+} kvhash;
+
+static Lock kvlk;
+static kvhash kvhashes[MAXKVHASH];
+static int nkvhash;
+
+/* generate a hash value from s, ignoring case */
+static
+uint
+foldhash(char *s, uint mult)
+{
+	uint h;
+	int c;
+	uchar *p;
+
+	h = 0;
+	for (p = (uchar *) s; (c = *p) != '\0'; p++) {
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		h = mult * h + c;
+	}
+
+	return h ^ (h >> 15);
+}
+
+/* search for a multiplier under which no two keys of kvlist share
+  * a slot, doubling the number of slots until one is found */
+static
+void
+buildkvhash(kvhash *kh, kvdef *kvlist, int nkvlist)
+{
+	uint mult, mask, h;
+	int i;
+
+	kh->kvlist = kvlist;
+	kh->nkvlist = nkvlist;
+	for (mask = 1; mask < 2 * nkvlist; mask <<= 1)
+		;
+	for (; mask <= KVMAXSLOT; mask <<= 1) {
+		kh->slot = erealloc(kh->slot, mask * sizeof(short));
+		for (mult = KVMULT; mult < KVMULT + 2048; mult += 2) {
+			memset(kh->slot, 0xff, mask * sizeof(short));
+			for (i = 0; i < nkvlist; i++) {
+				h = foldhash(kvlist[i].key, mult) & (mask - 1);
+				if (kh->slot[h] >= 0)
+					break;
+				kh->slot[h] = i;
+			}
+			if (i == nkvlist) {
+				kh->mult = mult;
+				kh->mask = mask - 1;
+				return;
+			}
+		}
+	}
+
+	sysfatal("buildkvhash: no perfect hash for %d keys; duplicate key?", nkvlist);
+}
+
+/* return the kvhash of kvlist, building it on first use */
+static
+kvhash *
+getkvhash(kvdef *kvlist, int nkvlist)
+{
+	kvhash *kh;
+	int i;
+
+	lock(&kvlk);
+	for (i = 0; i < nkvhash; i++) {
+		if (kvhashes[i].kvlist == kvlist && kvhashes[i].nkvlist == nkvlist) {
+			unlock(&kvlk);
+			return &kvhashes[i];
+		}
+	}
+	if (nkvhash == MAXKVHASH)
+		sysfatal("getkvhash: more than %d kvdef arrays", MAXKVHASH);
+	kh = &kvhashes[nkvhash];
+	buildkvhash(kh, kvlist, nkvlist);
+	nkvhash++;
+	unlock(&kvlk);
+
+	return kh;
+}
+
+/* return the index in kh->kvlist of key, or -1 */
+static
+int
+kvfind(kvhash *kh, char *key)
+{
+	int i;
+
+	i = kh->slot[foldhash(key, kh->mult) & kh->mask];
+	if (i < 0 || cistrcmp(kh->kvlist[i].key, key) != 0)
+		return -1;
+
+	return i;
+}
+
+/* return the index of the kvdef in kvlist whose key matches key,
+  * or -1 if there is none. kvindex searches case-insensitively */
+int
+kvindex(kvdef *kvlist, int nkvlist, char *key)
+{
+	if (kvlist == nil || nkvlist <= 0 || key == nil)
+		return -1;
+
+	return kvfind(getkvhash(kvlist, nkvlist), key);
+}
+
+/* create a new table with room for about n entries before it grows */
 table *
 mktable(int n)
 {
 	table *new;
+	int max;
 
 	if (n < 1)
 		return nil;
 
+	for (max = 8; max < 2 * n; max <<= 1)
+		;
+
 	new = ecalloc(1, sizeof(table));
 
-	new->entries = ecalloc(n, sizeof(entry *));
-	new->maxentry = n;
+	new->entries = ecalloc(max, sizeof(entry *));
+	new->maxentry = max;
 	new->nentry = 0;
 
 	return new;
 }
 
+/* create a new table where each key of kvlist has a fixed slot,
+  * found through a perfect hash. other keys go into a hash table
+  * that grows as needed */
+table *
+mkkvtable(kvdef *kvlist, int nkvlist)
+{
+	table *new;
+
+	if (kvlist == nil || nkvlist <= 0)
+		return nil;
+
+	new = mktable(4);
+	new->kvlist = kvlist;
+	new->nkvlist = nkvlist;
+	new->kvhash = getkvhash(kvlist, nkvlist);
+	new->known = ecalloc(nkvlist, sizeof(entry *));
+
+	return new;
+}
+
 /* obliterate table tp */
 void
 nuketable(table *tp)
 {
-	int i;
-	entry *np, *next;
+	anuketable(nil, tp);
+}
+
+/* obliterate table tp, leaving entries allocated from ap to nukearena */
+void
+anuketable(arena *ap, table *tp)
+{
+	entry *ep, *next;
 
 	if (tp == nil)
 		return;
 
-	for (i = 0; i < tp->maxentry; i++) {
-		for (np = tp->entries[i]; np != nil; np = next) {
-			next = np->next;
-			nukeentry(np);
-		}
+	for (ep = tp->head; ep != nil; ep = next) {
+		next = ep->next;
+		anukeentry(ap, ep);
 	}
 
+	free(tp->known);
 	free(tp->entries);
 	free(tp);
 }
 
+/* create an empty string pool */
+strpool *
+mkstrpool(void)
+{
+	strpool *new;
+
+	new = ecalloc(1, sizeof(strpool));
+	new->maxstr = 64;
+	new->strs = ecalloc(new->maxstr, sizeof(pstr *));
+
+	return new;
+}
+
+/* obliterate sp and every string in it. all entries holding
+  * strings from sp must have been freed */
+void
+nukestrpool(strpool *sp)
+{
+	pstr *np, *next;
+	int i;
+
+	if (sp == nil)
+		return;
+
+	for (i = 0; i < sp->maxstr; i++) {
+		for (np = sp->strs[i]; np != nil; np = next) {
+			next = np->next;
+			free(np);
+		}
+	}
+
+	free(sp->strs);
+	free(sp);
+}
+
+/* double the hash chains of sp. sp must be locked */
+static
+void
+growpool(strpool *sp)
+{
+	pstr **old, *np, *next;
+	int i, max;
+
+	old = sp->strs;
+	max = sp->maxstr;
+	sp->maxstr *= 2;
+	sp->strs = ecalloc(sp->maxstr, sizeof(pstr *));
+
+	for (i = 0; i < max; i++) {
+		for (np = old[i]; np != nil; np = next) {
+			next = np->next;
+			np->next = sp->strs[np->h & (sp->maxstr - 1)];
+			sp->strs[np->h & (sp->maxstr - 1)] = np;
+		}
+	}
+
+	free(old);
+}
+
+/* return sp's handle for s, adding s to sp if it is not there yet.
+  * every handle must be given back with unintern */
+char *
+intern(strpool *sp, char *s)
+{
+	pstr *np;
+	uint h;
+	int n;
+
+	if (sp == nil || s == nil)
+		return nil;
+
+	h = foldhash(s, 37);
+	lock(&sp->lk);
+	for (np = sp->strs[h & (sp->maxstr - 1)]; np != nil; np = np->next) {
+		if (np->h == h && strcmp((char *)(np + 1), s) == 0) {
+			np->ref++;
+			unlock(&sp->lk);
+			return (char *)(np + 1);
+		}
+	}
+
+	if (sp->nstr >= sp->maxstr)
+		growpool(sp);
+
+	n = strlen(s);
+	np = ecalloc(1, sizeof(pstr) + n + 1);
+	memmove(np + 1, s, n + 1);
+	np->h = h;
+	np->ref = 1;
+	np->next = sp->strs[h & (sp->maxstr - 1)];
+	sp->strs[h & (sp->maxstr - 1)] = np;
+	sp->nstr++;
+	unlock(&sp->lk);
+
+	return (char *)(np + 1);
+}
+
+/* give back a handle returned by intern. the string is freed
+  * once its last holder has given it back */
+void
+unintern(strpool *sp, char *s)
+{
+	pstr *np, **npp;
+
+	if (sp == nil || s == nil)
+		return;
+
+	np = (pstr *)s - 1;
+	lock(&sp->lk);
+	if (--np->ref == 0) {
+		for (npp = &sp->strs[np->h & (sp->maxstr - 1)]; *npp != np; npp = &(*npp)->next)
+			;
+		*npp = np->next;
+		sp->nstr--;
+		free(np);
+	}
+	unlock(&sp->lk);
+}
+
 /* create an entry object with the key field, and deserialise
   * value depending on type */
 entry *
 mkentry(char *key, char *value, int type)
+{
+	return amkentry(nil, key, value, type);
+}
+
+/* create an entry like mkentry in arena ap, or on the heap if ap is nil */
+entry *
+amkentry(arena *ap, char *key, char *value, int type)
+{
+	return pmkentry(nil, ap, key, value, type);
+}
+
+/* give back the interned strings of an entry from an arena; see pmkentry */
+static
+void
+dropentry(void *p)
+{
+	entry *ep;
+
+	ep = p;
+	unintern(ep->pool, ep->key);
+	if (ep->type == TSTRING || ep->type == TRUNE)
+		unintern(ep->pool, ep->s);
+}
+
+/* create an entry like amkentry, whose key and TSTRING or TRUNE
+  * value are interned in sp if it is non-nil. the strings of an
+  * entry in ap are given back when ap is nuked or reset */
+entry *
+pmkentry(strpool *sp, arena *ap, char *key, char *value, int type)
 {
 	entry *new;
 
 	if (key == nil || value == nil || type < TRUNE || type > TDOUBLE)
 		return nil;
 
-	new = ecalloc(1, sizeof(entry));
-	new->key = strdup(key);
+	new = aalloc(ap, sizeof(entry));
+	new->arena = ap;
+	new->pool = sp;
+	new->key = (sp != nil) ? intern(sp, key) : astrdup(ap, key);
 	new->type = type;
-	new->next = nil;
 
 	switch (new->type) {
 	case TRUNE:
-		new->S = estrrunedup(value);
-		break;
 	case TSTRING:
-		new->s = estrdup(value);
+		new->s = (sp != nil) ? intern(sp, value) : astrdup(ap, value);
 		break;
 	case TINT:
-		new->i = atoi(value);
+		new->i = spantol(value, -1);
 		break;
 	case TLONG:
-		new->l = atol(value);
+		new->l = spantol(value, -1);
 		break;
 	case TFLOAT:
-		new->f = atof(value);
+		new->f = spantod(value, -1);
 		break;
 	case TDOUBLE:
-		new->d = strtod(value, nil);
+		new->d = spantod(value, -1);
 		break;
 	}
 
+	if (sp != nil)
+		adefer(ap, dropentry, new);
+
 	return new;
 }
 
@@ -85,142 +388,289 @@ mkentry(char *key, char *value, int type)
 void
 nukeentry(entry *ep)
 {
-	if (ep == nil)
+	anukeentry(nil, ep);
+}
+
+/* free an entry like nukeentry, leaving anything allocated from ap to nukearena.
+  * an entry from an arena holds nothing else, and is left whole */
+void
+anukeentry(arena *ap, entry *ep)
+{
+	if (ep == nil || ep->arena != nil)
 		return;
 
-	free(ep->key);
-	if (ep->type == TRUNE)
-		free(ep->S);
-	else if (ep->type == TSTRING)
-		free(ep->s);
-	free(ep);
+	if (ep->pool != nil) {
+		unintern(ep->pool, ep->key);
+		if (ep->type == TSTRING || ep->type == TRUNE)
+			unintern(ep->pool, ep->s);
+	} else {
+		afree(ap, ep->key);
+		if (ep->type == TSTRING || ep->type == TRUNE)
+			afree(ap, ep->s);
+	}
+	afree(ap, ep->src);
+	afree(ap, ep->S);
+	afree(ap, ep);
 }
 
-/* generate a hash value across range n from s */
+/* replace the TSTRING or TRUNE value of ep with s, which was allocated
+  * from ap, and mark ep as modified. s is interned if ep's strings are,
+  * and copied into ep's arena if it lives elsewhere */
+void
+asetentrys(arena *ap, entry *ep, char *s)
+{
+	if (ep == nil || (ep->type != TSTRING && ep->type != TRUNE))
+		return;
+
+	afree(ep->arena, ep->S);
+	ep->S = nil;
+
+	if (ep->pool != nil) {
+		unintern(ep->pool, ep->s);
+		ep->s = intern(ep->pool, s);
+		afree(ap, s);
+	} else {
+		afree(ep->arena, ep->s);
+		if (ep->arena != nil && inarena(ep->arena, s) == 0) {
+			ep->s = astrdup(ep->arena, s);
+			afree(ap, s);
+		} else
+			ep->s = s;
+	}
+	ep->dirty = 1;
+}
+
+/* home slot of key in tp->entries */
+#define homeslot(tp, key) (foldhash((key), 37) & ((tp)->maxentry - 1))
+
+/* put ep into the first free slot at or after its home slot.
+  * if stack is set, ep goes before any entries with the same key,
+  * so that the most recently added one is found first */
 static
-uint
-hash(char *s, int n)
+void
+putother(table *tp, entry *ep, int stack)
 {
-	static int mult = 37;
-	uint h;
-	uchar *p;
+	entry *tmp;
+	uint h, mask;
+
+	mask = tp->maxentry - 1;
+	for (h = homeslot(tp, ep->key); tp->entries[h] != nil; h = (h + 1) & mask) {
+		if (stack && (tp->entries[h]->key == ep->key || cistrcmp(tp->entries[h]->key, ep->key) == 0)) {
+			tmp = tp->entries[h];
+			tp->entries[h] = ep;
+			ep = tmp;
+		}
+	}
+	tp->entries[h] = ep;
+}
 
-	if (s == nil)
-		return -1;
+/* double the slots in tp->entries, keeping entries with equal keys in order */
+static
+void
+growother(table *tp)
+{
+	entry **old;
+	int i, h, max;
+
+	old = tp->entries;
+	max = tp->maxentry;
+	tp->maxentry *= 2;
+	tp->entries = ecalloc(tp->maxentry, sizeof(entry *));
+
+	/* start after a free slot, so every probe run is visited front to back */
+	for (h = 0; old[h] != nil; h++)
+		;
+	for (i = 1; i <= max; i++)
+		if (old[(h + i) % max] != nil)
+			putother(tp, old[(h + i) % max], 0);
+
+	free(old);
+}
 
-	h = 0;
-	for (p = (uchar *) s; *p != '\0'; p++)
-		h = mult * h + *p;
+/* returns the slot of ep in tp->entries, or -1 */
+static
+int
+findother(table *tp, entry *ep)
+{
+	uint h, mask;
+
+	mask = tp->maxentry - 1;
+	for (h = homeslot(tp, ep->key); tp->entries[h] != nil; h = (h + 1) & mask)
+		if (tp->entries[h] == ep)
+			return h;
 
-	return h % n;
+	return -1;
+}
+
+/* empty slot h of tp->entries, then close the gap by moving back
+  * later entries of the probe run whose home slot does not lie
+  * between the gap and themselves */
+static
+void
+rmother(table *tp, uint h)
+{
+	uint j, k, mask;
+
+	mask = tp->maxentry - 1;
+	tp->entries[h] = nil;
+	for (j = (h + 1) & mask; tp->entries[j] != nil; j = (j + 1) & mask) {
+		k = homeslot(tp, tp->entries[j]->key);
+		if (h <= j ? (h < k && k <= j) : (h < k || k <= j))
+			continue;
+		tp->entries[h] = tp->entries[j];
+		tp->entries[j] = nil;
+		h = j;
+	}
+	tp->nother--;
 }
 
 /* find the entry in tp whose key field matches key
   * returns the found entry, or nil if no matches.
-  * lookup searches case-insensitively */
+  * lookup searches case-insensitively; a key interned in the
+  * entries' pool is found by pointer without comparing strings */
 entry *
 lookupentry(table *tp, char *key)
 {
-	uint h;
-	entry *np;
+	uint h, mask;
+	int i;
 
 	if (tp == nil || key == nil)
 		return nil;
 
-	h = hash(key, tp->maxentry);
-	for (np = tp->entries[h]; np != nil; np = np->next)
-		if (cistrcmp(key, np->key) == 0)
-			return np;
+	if (tp->kvhash != nil && (i = kvfind(tp->kvhash, key)) >= 0 && tp->known[i] != nil)
+		return tp->known[i];
+
+	mask = tp->maxentry - 1;
+	for (h = homeslot(tp, key); tp->entries[h] != nil; h = (h + 1) & mask)
+		if (key == tp->entries[h]->key || cistrcmp(key, tp->entries[h]->key) == 0)
+			return tp->entries[h];
 
 	return nil;
 }
 
-/* return the next entry in ep's hash chain, or the first
-  * entry of the next hash chain if ep is the final object in
-  * its chain. if ep is nil, nextentry returns the first entry
-  * in the next hash chain.
+/* return the entry added to tp after ep, or the first entry
+  * if ep is nil. ep must be in tp.
   * returns nil when the entire table has been exhausted */
 entry *
 nextentry(table *tp, entry *ep)
 {
-	uint h;
-	entry *np;
-
 	if (tp == nil)
 		return nil;
 
-	if (ep == nil) {
-		h = 0;
-		for (h = 0; h != tp->maxentry; h++)
-			if (tp->entries[h] != nil)
-				return tp->entries[h];
+	return (ep == nil) ? tp->head : ep->next;
+}
 
-		return nil;
-	}
+/* start iterating over tp in insertion order */
+void
+inittabiter(tabiter *ip, table *tp)
+{
+	ip->tp = tp;
+	ip->next = (tp != nil) ? tp->head : nil;
+}
 
-	h = hash(ep->key, tp->maxentry);
-	for (np = tp->entries[h]; np != nil; np = np->next) {
-		if (np->next == nil) {
-			for (h++; h != tp->maxentry; h++)
-				if (tp->entries[h] != nil)
-					return tp->entries[h];
+/* return the next entry of ip's table, or nil once all have been returned */
+entry *
+tabnext(tabiter *ip)
+{
+	entry *ep;
 
-			return nil;
-		} else if (np == ep) {
-			return np->next;
-		}
-	}
+	if ((ep = ip->next) != nil)
+		ip->next = ep->next;
 
-	/* entry not in table */
-	return nil;
+	return ep;
 }
 
-/* prepend ep to the appropriate hash chain in tp */
+/* add ep to table tp. a later entry with the same key as an
+  * earlier one hides it from lookupentry */
 entry *
 addentry(table *tp, entry *ep)
 {
-	uint h;
+	entry *old;
+	int i;
 
 	if (tp == nil || ep == nil)
 		return nil;
 
-	h = hash(ep->key, tp->maxentry);
-	ep->next = tp->entries[h];
-	tp->entries[h] = ep;
+	old = ep;
+	if (tp->kvhash != nil && (i = kvfind(tp->kvhash, ep->key)) >= 0) {
+		old = tp->known[i];
+		tp->known[i] = ep;
+	}
+	if (old != nil) {
+		if (2 * (tp->nother + 1) > tp->maxentry)
+			growother(tp);
+		putother(tp, old, 1);
+		tp->nother++;
+	}
+
+	ep->prev = tp->tail;
+	ep->next = nil;
+	if (tp->tail != nil)
+		tp->tail->next = ep;
+	else
+		tp->head = ep;
+	tp->tail = ep;
 	tp->nentry++;
 
 	return ep;
 }
 
 /* remove entry ep from table tp
-  * returns a pointer to ep, ready to be fed into nukeentry if so desired */
+  * returns a pointer to ep, ready to be fed into nukeentry if so desired,
+  * or nil if ep is not in tp */
 entry *
 rmentry(table *tp, entry *ep)
 {
-	uint h;
-	entry *np;
+	int i;
 
 	if (tp == nil || ep == nil)
 		return nil;
 
-	h = hash(ep->key, tp->maxentry);
-	if (tp->entries[h] == nil) {
-		return ep;
-	} else if (tp->entries[h] == ep) {
-		tp->entries[h] = ep->next;
-		ep->next = nil;
-		tp->nentry--;
-		return ep;
-	}
+	if (tp->kvhash != nil && (i = kvfind(tp->kvhash, ep->key)) >= 0 && tp->known[i] == ep)
+		tp->known[i] = nil;
+	else if ((i = findother(tp, ep)) >= 0)
+		rmother(tp, i);
+	else
+		return nil;
 
-	for (np = tp->entries[h]; np->next != nil; np = np->next) {
-		if (np->next == ep) {
-			np->next = ep->next;
-			ep->next = nil;
-			tp->nentry--;
-			return ep;
-		}
-	}
+	if (ep->prev != nil)
+		ep->prev->next = ep->next;
+	else
+		tp->head = ep->next;
+	if (ep->next != nil)
+		ep->next->prev = ep->prev;
+	else
+		tp->tail = ep->prev;
+	ep->prev = ep->next = nil;
+	tp->nentry--;
+
+	return ep;
+}
+
+/* returns the value of the TRUNE entry ep as runes. they are decoded
+  * on first use into the arena ep came from, or onto the heap, and kept
+  * until the value is replaced or ep is freed. an entry in a reader's
+  * scratch arena takes them along when the arena is reset.
+  * must not be called by several procs at once on one entry, or on
+  * entries sharing an arena. returns nil if ep is not a TRUNE entry */
+Rune *
+entryrunes(entry *ep)
+{
+	if (ep == nil || ep->type != TRUNE)
+		return nil;
+
+	if (ep->S == nil)
+		ep->S = astrrunedup(ep->arena, ep->s);
+
+	return ep->S;
+}
 
-	return nil; /* unreachable */
+/* mark ep as modified, so that writemap formats it instead of writing
+  * back the text it was parsed from. must be called after changing
+  * ep's value directly. */
+void
+dirtyentry(entry *ep)
+{
+	if (ep != nil)
+		ep->dirty = 1;
 }
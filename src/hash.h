@@ -1,6 +1,6 @@
 /* hash table data types & associated manipulation functions */
 enum types {
-	TRUNE=0,
+	TRUNE=0,		/* UTF-8 string with a Rune view; see entryrunes */
 	TSTRING,
 	TINT,
 	TLONG,
@@ -8,35 +8,103 @@ enum types {
 	TDOUBLE,
 } types;
 
+/* header of a string interned in a strpool. the string itself follows
+  * the header, and the handle intern returns points at it, so interned
+  * strings can be used wherever a char * is */
+typedef struct pstr pstr;
+typedef struct pstr {
+	pstr *next;		/* next in hash chain */
+	long ref;		/* number of holders of the handle */
+	uint h;		/* hash of the string */
+} pstr;
+
+/* pool of interned strings, which may be shared by many beatmaps and procs.
+  * two handles from the same pool are equal strings iff they are equal pointers */
+typedef struct strpool {
+	Lock lk;
+	pstr **strs;		/* hash chains */
+	int maxstr;		/* number of chains; a power of two */
+	long nstr;		/* number of distinct strings in the pool */
+} strpool;
+
 typedef struct entry entry;
 typedef struct entry {
-	entry *next;	/* next in hash chain */
+	entry *prev;	/* previous entry in insertion order */
+	entry *next;	/* next entry in insertion order */
 
 	char *key;		/* configuration key */
 
 	int type;		/* one of (:0/enum types/) */
 	union {
-		Rune *S;
-		char *s;
+		char *s;		/* TSTRING and TRUNE */
 		int i;
 		long l;
 		float f;
 		double d;
 	};
+
+	Rune *S;		/* Rune view of a TRUNE value; nil until entryrunes decodes it */
+	arena *arena;	/* arena the entry was allocated from, or nil; S is decoded there too */
+
+	char *src;		/* definition the entry was parsed from, if any */
+	strpool *pool;	/* if non-nil, key and string values are interned here */
+	int dirty;		/* entry was modified since parsing; clean entries are written back as src */
 } entry;
 
+/* key-value pair definition */
+typedef struct kvdef {
+	char *key;		/* string key of entry */
+	char *fmt;		/* format string for output */
+	int type;		/* the data type of the associated value. see (:0/enum types/) */
+} kvdef;
+
+/* collision-free hash over the keys of a kvdef array; private to hash.c */
+typedef struct kvhash kvhash;
+
 typedef struct table table;
 typedef struct table {
-	entry **entries;		/* list of entries */
-	int maxentry;		/* number of entry pointers in entries[] */
+	kvdef *kvlist;		/* keys with a slot of their own in known[], or nil */
+	int nkvlist;		/* number of kvdefs in kvlist */
+	kvhash *kvhash;		/* perfect hash of kvlist */
+	entry **known;		/* entry for each kvdef, indexed like kvlist */
+
+	entry **entries;		/* open-addressed slots for every other entry */
+	int maxentry;		/* number of slots in entries[]; a power of two */
+	int nother;			/* number of entries in entries[] */
+
+	entry *head;		/* first entry in insertion order */
+	entry *tail;		/* last entry in insertion order */
 	int nentry;			/* total number of entries inserted into table */
 } table;
 
+/* iteration state over a table in insertion order. the entry
+  * most recently returned may be removed from the table while
+  * iterating, but no other entry */
+typedef struct tabiter {
+	table *tp;
+	entry *next;		/* entry to return next */
+} tabiter;
+
 table *mktable(int n);
+table *mkkvtable(kvdef *kvlist, int nkvlist);
+int kvindex(kvdef *kvlist, int nkvlist, char *key);
 void nuketable(table *tp);
+void anuketable(arena *ap, table *tp);
+strpool *mkstrpool(void);
+void nukestrpool(strpool *sp);
+char *intern(strpool *sp, char *s);
+void unintern(strpool *sp, char *s);
 entry *mkentry(char *key, char *value, int type);
+entry *amkentry(arena *ap, char *key, char *value, int type);
+entry *pmkentry(strpool *sp, arena *ap, char *key, char *value, int type);
+void asetentrys(arena *ap, entry *ep, char *s);
+Rune *entryrunes(entry *ep);
 void nukeentry(entry *ep);
+void anukeentry(arena *ap, entry *ep);
 entry *lookupentry(table *tp, char *key);
 entry *nextentry(table *tp, entry *ep);
 entry *addentry(table *tp, entry *ep);
 entry *rmentry(table *tp, entry *ep);
+void inittabiter(tabiter *ip, table *tp);
+entry *tabnext(tabiter *ip);
+void dirtyentry(entry *ep);
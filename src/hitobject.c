@@ -2,22 +2,33 @@
 #include <libc.h>
 #include <stdio.h>
 #include "aux.h"
+#include "arena.h"
 #include "hitsound.h"
 #include "hitobject.h"
 
 /* creates a new object */
 hitobject *
 mkobj(uchar type, double t, int x, int y)
+{
+	return amkobj(nil, type, t, x, y);
+}
+
+/* creates a new object in arena arp, or on the heap if arp is nil */
+hitobject *
+amkobj(arena *arp, uchar type, double t, int x, int y)
 {
 	hitobject *new;
-	anchor *ap;
 
-	new = ecalloc(1, sizeof(hitobject));
-	ap = mkanch(x, y);
+	new = aalloc(arp, sizeof(hitobject));
+	new->arena = arp;
+	new->anchors = aalloc(arp, sizeof(anchor));
+	new->anchors[0].x = x;
+	new->anchors[0].y = y;
+	new->nanchors = 1;
+	new->maxanchors = 1;
 
 	new->type = type;
 	new->t = t;
-	new->anchors = ap;
 	new->next = nil;
 
 	return new;
@@ -27,22 +38,26 @@ mkobj(uchar type, double t, int x, int y)
 void
 nukeobj(hitobject *op)
 {
-	anchor *ap, *next;
+	anukeobj(nil, op);
+}
 
-	if (op == nil)
+/* free an object like nukeobj, leaving anything allocated from arp
+  * to be released by nukearena. an object from an arena holds nothing
+  * else, and is left whole */
+void
+anukeobj(arena *arp, hitobject *op)
+{
+	if (op == nil || op->arena != nil)
 		return;
 
-	for (ap = op->anchors; ap != nil; ap = next) {
-		next = ap->next;
-		free(ap);
-	}
-
-	free(op->sladditions);
-	free(op->slnormalsets);
-	free(op->sladditionsets);
-	nukehitsamp(op->hitsamp);
+	afree(arp, op->anchors);
+	afree(arp, op->src);
+	afree(arp, op->sladditions);
+	afree(arp, op->slnormalsets);
+	afree(arp, op->sladditionsets);
+	anukehitsamp(arp, op->hitsamp);
 
-	free(op);
+	afree(arp, op);
 }
 
 /* inserts an object into the list based on its time value.
@@ -83,6 +98,99 @@ addobjt(hitobject *listp, hitobject *op)
 	return nil; /* unreachable */
 }
 
+/* adds op to listp in constant time for bulk loading, and returns a pointer
+  * to the list's head. *tailp tracks the last object in listp; if it is nil,
+  * loadobj finds it. like addobjt, objects whose time does not come after
+  * the head's are prepended; all others are appended, leaving listp to be
+  * put in order by a single call to sortobjt once loading is done. */
+hitobject *
+loadobj(hitobject *listp, hitobject **tailp, hitobject *op)
+{
+	hitobject *np;
+
+	if (op == nil || tailp == nil)
+		return nil;
+
+	if (listp == nil) {
+		op->next = nil;
+		*tailp = op;
+		return op;
+	}
+
+	if (op->t <= listp->t) {
+		op->next = listp;
+		return op;
+	}
+
+	if (*tailp == nil)
+		for (*tailp = listp; (*tailp)->next != nil; *tailp = (*tailp)->next)
+			;
+
+	np = *tailp;
+	op->next = nil;
+	np->next = op;
+	*tailp = op;
+
+	return listp;
+}
+
+/* sorts listp by time value with a stable merge sort; objects with equal
+  * timestamps keep their relative order. lists that are already in order
+  * are returned after a single pass.
+  * returns a pointer to the list's head */
+hitobject *
+sortobjt(hitobject *listp)
+{
+	hitobject *p, *q, *e, *tail;
+	int insize, nmerges, psize, qsize, i;
+
+	for (p = listp; p != nil && p->next != nil; p = p->next)
+		if (p->next->t < p->t)
+			break;
+
+	if (p == nil || p->next == nil)
+		return listp;
+
+	for (insize = 1;; insize *= 2) {
+		p = listp;
+		listp = tail = nil;
+		nmerges = 0;
+
+		while (p != nil) {
+			nmerges++;
+			q = p;
+			for (psize = 0, i = 0; i < insize && q != nil; i++, psize++)
+				q = q->next;
+			qsize = insize;
+
+			while (psize > 0 || (qsize > 0 && q != nil)) {
+				if (psize == 0 || (qsize > 0 && q != nil && q->t < p->t)) {
+					e = q;
+					q = q->next;
+					qsize--;
+				} else {
+					e = p;
+					p = p->next;
+					psize--;
+				}
+
+				if (tail != nil)
+					tail->next = e;
+				else
+					listp = e;
+				tail = e;
+			}
+
+			p = q;
+		}
+
+		tail->next = nil;
+
+		if (nmerges <= 1)
+			return listp;
+	}
+}
+
 /* changes hitobject op's time to t, and adjust its position in listp */
 hitobject *
 moveobjt(hitobject *listp, hitobject *op, double t)
@@ -92,10 +200,160 @@ moveobjt(hitobject *listp, hitobject *op, double t)
 
 	listp = rmobj(listp, op);
 	op->t = t;
+	op->moved = 1;
 
 	return addobjt(listp, op);
 }
 
+/* mark op as modified, so that writemap formats it instead of writing
+  * back the text it was parsed from. code that changes an object's
+  * fields or anchors without the set* routines must call dirtyobj. */
+void
+dirtyobj(hitobject *op)
+{
+	if (op != nil)
+		op->dirty = 1;
+}
+
+/* move the head anchor of op to x, y */
+void
+setobjxy(hitobject *op, int x, int y)
+{
+	if (op == nil || op->nanchors < 1)
+		return;
+
+	op->anchors[0].x = x;
+	op->anchors[0].y = y;
+	op->dirty = 1;
+}
+
+/* set the new combo flag and the number of combo colours to skip of op */
+void
+setobjcombo(hitobject *op, int newcombo, int comboskip)
+{
+	if (op == nil)
+		return;
+
+	op->newcombo = newcombo;
+	op->comboskip = comboskip;
+	op->dirty = 1;
+}
+
+/* insert *ap into the nanchors anchors in a in position n, like
+  * addanchn. a must have room for one more anchor */
+static
+void
+putanch(anchor *a, int nanchors, anchor *ap, uint n)
+{
+	if (n == 0 || n > nanchors)
+		n = nanchors + 1;
+
+	memmove(&a[n], &a[n-1], (nanchors - (n-1)) * sizeof(anchor));
+	a[n-1] = *ap;
+}
+
+/* insert a copy of ap into op in position n, counting from 1.
+  * if n is 0 or past the tail, the anchor is appended.
+  * the anchors are grown in op's arena, or on the heap.
+  * ap is not kept, so it may come from mkanch, amkanch or the stack.
+  * returns a pointer to op's anchors */
+anchor *
+addobjanch(hitobject *op, anchor *ap, uint n)
+{
+	anchor *new;
+	int max;
+
+	if (op == nil || ap == nil)
+		return nil;
+
+	if (op->nanchors >= op->maxanchors) {
+		max = (op->nanchors > 2) ? op->nanchors * 2 : 4;
+		new = aalloc(op->arena, max * sizeof(anchor));
+		memmove(new, op->anchors, op->nanchors * sizeof(anchor));
+		afree(op->arena, op->anchors);
+		op->anchors = new;
+		op->maxanchors = max;
+	}
+
+	putanch(op->anchors, op->nanchors, ap, n);
+	op->nanchors++;
+	op->dirty = 1;
+
+	return op->anchors;
+}
+
+/* returns op's hitsample ready to be modified, and marks op dirty.
+  * a pooled hitsample is shared with other objects, so op gets a
+  * copy of its own in its arena, or on the heap, first.
+  * returns nil if op has no hitsample */
+hitsamp *
+edithitsamp(hitobject *op)
+{
+	hitsamp *hsp;
+
+	if (op == nil || op->hitsamp == nil)
+		return nil;
+
+	if (op->hitsamp->pool != nil) {
+		hsp = acopyhitsamp(op->arena, op->hitsamp);
+		if (op->arena == nil)
+			nukehitsamp(op->hitsamp);
+		op->hitsamp = hsp;
+	}
+	op->dirty = 1;
+
+	return op->hitsamp;
+}
+
+/* returns the anchor after ap in op, or nil if ap is the last one.
+  * lets code walk an object's anchors like a list:
+  *	for (ap = op->anchors; ap != nil; ap = nextanch(op, ap)) */
+anchor *
+nextanch(hitobject *op, anchor *ap)
+{
+	if (op == nil || ap == nil || ap + 1 >= op->anchors + op->nanchors)
+		return nil;
+
+	return ap + 1;
+}
+
+/* creates a new anchor */
+anchor *
+mkanch(int x, int y)
+{
+	return amkanch(nil, x, y);
+}
+
+/* creates a new anchor in arena arp, or on the heap if arp is nil */
+anchor *
+amkanch(arena *arp, int x, int y)
+{
+	anchor *new;
+
+	new = aalloc(arp, sizeof(anchor));
+	new->x = x;
+	new->y = y;
+
+	return new;
+}
+
+/* adds a copy of ap to the *nanchors anchors in a, a heap array or nil,
+  * in position n, and counts it in *nanchors.
+  * if n is 0, addanchn appends the anchor to the end of the array.
+  * returns a pointer to the array, which may have moved */
+anchor *
+addanchn(anchor *a, int *nanchors, anchor *ap, uint n)
+{
+	if (nanchors == nil || ap == nil)
+		return nil;
+
+	a = erealloc(a, (*nanchors + 1) * sizeof(anchor));
+	putanch(a, *nanchors, ap, n);
+	(*nanchors)++;
+
+	return a;
+}
+
 /* removes the hitobject pointed to by op from listp */
 hitobject *
 rmobj(hitobject *listp, hitobject *op)
@@ -201,59 +459,6 @@ lookupobjstr(hitobject *listp, int *selected, char *s)
 	return (op->t >= t) ? op : op->next;
 }
 
-/* creates a new anchor */
-anchor *
-mkanch(int x, int y)
-{
-	anchor *new;
-
-	new = ecalloc(1, sizeof(anchor));
-	new->x = x;
-	new->y = y;
-	new->next = nil;
-
-	return new;
-}
-
-/* adds an anchor to alistp in position n.
-  * if n is 0, addanchn appends anchor to the end of the list.
-   * returns a pointer to the list's head */
-anchor *
-addanchn(anchor *alistp, anchor *ap, uint n)
-{
-	anchor *np;
-	int i;
-
-	if (n < 0)
-		return nil;
-
-	if (alistp == nil)
-		return ap;
-
-	if (n == 1) {
-		ap->next = alistp;
-		return ap;
-	}
-
-	if (n == 0) {
-		for (np = alistp; np->next != nil; np = np->next)
-			;
-	} else {
-		np = alistp;
-		for (i = 1; i < n-1; i++) {
-			if (np->next == nil)
-				break;
-
-			np = np->next;
-		}
-	}
-
-	ap->next = np->next;
-	np->next = ap;
-
-	return alistp;
-}
-
 /* calculates the distance between points (x1,y1) and (x2,y2)
   * using Pythagoras' theorem */
 float
@@ -263,28 +468,29 @@ hypotenuselen(float x1, float y1, float x2, float y2)
 }
 
 
-/* interpolates a point on a n-order bezier curve denoted by alistp,
-  * where 0 <= t <= 1.
+/* interpolates a point on a n-order bezier curve denoted by the
+  * n+1 control points in anchors, where 0 <= t <= 1.
   * writes the coordinates of this point to *x and *y.
   * returns 0 on success, negative values for failures.
   */
 int
-bezierpoint(anchor *alistp, int n, float *x, float *y, float t)
+bezierpoint(anchor *anchors, int n, float *x, float *y, float t)
 {
-	float nx, ny;
+	double nx, ny, b, c;
 	int k;
-	anchor *ap;
 
-	if (alistp == nil || x == nil || y == nil || t < 0 || t > 1)
+	if (anchors == nil || x == nil || y == nil || t < 0 || t > 1)
 		return -1;
 
 	nx = ny = 0;
 
-	ap = alistp;
+	/* c is the binomial coefficient (n k), built up term by term */
+	c = 1;
 	for (k = 0; k <= n; k++) {
-		nx += ap->x * (fact(n) / (fact(k) * fact(n - k))) * pow(1 - t, n - k) * pow(t, k);
-		ny += ap->y * (fact(n) / (fact(k) * fact(n - k))) * pow(1 - t, n - k) * pow(t, k);
-		ap = ap->next;
+		b = c * pow(1 - t, n - k) * pow(t, k);
+		nx += anchors[k].x * b;
+		ny += anchors[k].y * b;
+		c = c * (n - k) / (k + 1);
 	}
 
 	*x = nx;
@@ -294,26 +500,26 @@ bezierpoint(anchor *alistp, int n, float *x, float *y, float t)
 }
 
 /* returns the length of the curve denoted by the first
-  * nanchors control points in alistp
+  * nanchors control points in anchors
   *
   * returns the length of the curve in osu! pixels on success,
   * negative values on failure.
   */
 float
-bezierlen(anchor *alistp, int nanchors)
+bezierlen(anchor *anchors, int nanchors)
 {
 	static float step = 0.0125;
 	float t, len, x1, y1, x2, y2;
 
-	if (alistp == nil || nanchors < 1)
+	if (anchors == nil || nanchors < 1)
 		return -1;
 
 	len = 0;
-	if (bezierpoint(alistp, nanchors - 1, &x1, &y1, 0) < 0)
+	if (bezierpoint(anchors, nanchors - 1, &x1, &y1, 0) < 0)
 		return -1;
 
 	for (t = step; t < 1; t += step) {
-		if (bezierpoint(alistp, nanchors - 1, &x2, &y2, t) < 0)
+		if (bezierpoint(anchors, nanchors - 1, &x2, &y2, t) < 0)
 			return -1;
 
 		len += hypotenuselen(x1, y1, x2, y2);
@@ -14,10 +14,9 @@ enum {
 	CRVPERFECT = 'P',	/* perfect circular curve */
 } curvetypes;
 
-typedef struct anchor anchor;
+/* slider control point; an object's anchors are packed in one array */
 typedef struct anchor {
 	int x, y;			/* x and y positions in 'osu pixels' */
-	anchor *next;		/* next anchor in the list. If nil, this anchor is a slider tail. */
 } anchor;
 
 /* A hitobject may refer to a circle, slider, or spinner. */
@@ -26,7 +25,9 @@ typedef struct hitobject {
 	hitobject *next;	/* next node in object list */
 
 	double t;			/* timestamp in ms */
-	anchor *anchors;	/* head of anchor list */
+	anchor *anchors;	/* control points; anchors[0] is the object's position, the last one a slider's tail */
+	int nanchors;		/* number of elements in anchors */
+	int maxanchors;	/* capacity of anchors */
 	uchar type;		/* one of enum objtypes */
 	int typebits;		/* remaining type bits (old osu! beatmaps) */
 					/* typebit bits 0 through 7 will be overwritten by the values of type, newcombo,
@@ -52,18 +53,36 @@ typedef struct hitobject {
 
 	/* spinners */
 	double spinnerlength;  /* spinner duration in ms */
+
+	/* passthrough */
+	char *src;			/* definition the object was parsed from, if any */
+	int dirty;			/* object was modified since parsing; clean objects are written back as src */
+	int moved;			/* only t was changed; a clean object is written back as src with the new time */
+
+	arena *arena;		/* arena the object was allocated from, or nil; everything it holds lives there too */
 } hitobject;
 
 hitobject *mkobj(uchar type, double t, int x, int y);
+hitobject *amkobj(arena *arp, uchar type, double t, int x, int y);
 void nukeobj(hitobject *obj);
+void anukeobj(arena *arp, hitobject *obj);
 hitobject *addobjt(hitobject *listp, hitobject *op);
+hitobject *loadobj(hitobject *listp, hitobject **tailp, hitobject *op);
+hitobject *sortobjt(hitobject *listp);
 hitobject *moveobjt(hitobject *listp, hitobject *op, double t);
+void dirtyobj(hitobject *op);
+void setobjxy(hitobject *op, int x, int y);
+void setobjcombo(hitobject *op, int newcombo, int comboskip);
+anchor *addobjanch(hitobject *op, anchor *ap, uint n);
+hitsamp *edithitsamp(hitobject *op);
+anchor *nextanch(hitobject *op, anchor *ap);
 hitobject *rmobj(hitobject *listp, hitobject *op);
 hitobject *lookupobjt(hitobject *listp, double t);
 hitobject *lookupobjn(hitobject *listp, uint n);
 hitobject *lookupobjstr(hitobject *listp, int *selected, char *s);
 anchor *mkanch(int x, int y);
-anchor *addanchn(anchor *alistp, anchor *ap, uint n);
+anchor *amkanch(arena *arp, int x, int y);
+anchor *addanchn(anchor *a, int *nanchors, anchor *ap, uint n);
 float hypotenuselen(float x1, float y1, float x2, float y2);
-int bezierpoint(anchor *alistp, int n, float *x, float *y, float t);
-float bezierlen(anchor *alistp, int nanchors);
\ No newline at end of file
+int bezierpoint(anchor *anchors, int n, float *x, float *y, float t);
+float bezierlen(anchor *anchors, int nanchors);
\ No newline at end of file
@@ -1,14 +1,24 @@
 #include <u.h>
 #include <libc.h>
 #include "aux.h"
+#include "arena.h"
 #include "hitsound.h"
 
 hitsamp *
-mkhitsamp(int normal, int addition, int index, int volume, Rune *file)
+mkhitsamp(int normal, int addition, int index, int volume, char *file)
+{
+	return amkhitsamp(nil, normal, addition, index, volume, file);
+}
+
+/* create a new hitsample in arena ap, or on the heap if ap is nil.
+  * the hitsample takes over file, which must come from ap as well */
+hitsamp *
+amkhitsamp(arena *ap, int normal, int addition, int index, int volume, char *file)
 {
 	hitsamp *new;
 
-	new = ecalloc(1, sizeof(hitsamp));
+	new = aalloc(ap, sizeof(hitsamp));
+	new->arena = ap;
 
 	new->normal = normal;
 	new->addition = addition;
@@ -19,12 +29,213 @@ mkhitsamp(int normal, int addition, int index, int volume, Rune *file)
 	return new;
 }
 
+/* copy hsp, along with its filename, into ap. the copy is never pooled */
+hitsamp *
+acopyhitsamp(arena *ap, hitsamp *hsp)
+{
+	if (hsp == nil)
+		return nil;
+
+	return amkhitsamp(ap, hsp->normal, hsp->addition, hsp->index, hsp->volume, astrdup(ap, hsp->file));
+}
+
 void
 nukehitsamp(hitsamp *hsp)
 {
+	anukehitsamp(nil, hsp);
+}
+
+/* free a hitsample, leaving anything allocated from ap to nukearena.
+  * a pooled hitsample loses an owner, and is freed with the last one */
+void
+anukehitsamp(arena *ap, hitsamp *hsp)
+{
+	samppool *pp;
+	hitsamp **hpp;
+
 	if (hsp == nil)
 		return;
 
-	free(hsp->file);
-	free(hsp);
+	if ((pp = hsp->pool) != nil) {
+		lock(&pp->lk);
+		if (--hsp->ref > 0) {
+			unlock(&pp->lk);
+			return;
+		}
+		for (hpp = &pp->samps[hsp->h & (pp->maxsamp - 1)]; *hpp != hsp; hpp = &(*hpp)->next)
+			;
+		*hpp = hsp->next;
+		pp->nsamp--;
+		unlock(&pp->lk);
+		ap = nil;
+	}
+
+	afree(ap, hsp->file);
+	afree(ap, hsp->filerunes);
+	afree(ap, hsp);
+}
+
+/* returns the filename of hsp as runes. they are decoded on first use
+  * into the arena hsp came from, or onto the heap, and kept until hsp is
+  * freed. the decode of a pooled hitsample is done under the pool's lock,
+  * since other procs may share it; any other hitsample must not be passed
+  * in by several procs at once, nor alongside others from its arena.
+  * returns nil if hsp has no filename */
+Rune *
+sampfilerunes(hitsamp *hsp)
+{
+	Rune *r;
+
+	if (hsp == nil || hsp->file == nil)
+		return nil;
+
+	if (hsp->pool == nil) {
+		if (hsp->filerunes == nil)
+			hsp->filerunes = astrrunedup(hsp->arena, hsp->file);
+		return hsp->filerunes;
+	}
+
+	lock(&hsp->pool->lk);
+	if (hsp->filerunes == nil)
+		hsp->filerunes = estrrunedup(hsp->file);
+	r = hsp->filerunes;
+	unlock(&hsp->pool->lk);
+
+	return r;
+}
+
+/* create an empty hitsample pool */
+samppool *
+mksamppool(void)
+{
+	samppool *new;
+
+	new = ecalloc(1, sizeof(samppool));
+	new->maxsamp = 16;
+	new->samps = ecalloc(new->maxsamp, sizeof(hitsamp *));
+
+	return new;
+}
+
+/* obliterate pp and every hitsample in it. all objects
+  * holding hitsamples from pp must have been freed */
+void
+nukesamppool(samppool *pp)
+{
+	hitsamp *hsp, *next;
+	int i;
+
+	if (pp == nil)
+		return;
+
+	for (i = 0; i < pp->maxsamp; i++) {
+		for (hsp = pp->samps[i]; hsp != nil; hsp = next) {
+			next = hsp->next;
+			free(hsp->file);
+			free(hsp->filerunes);
+			free(hsp);
+		}
+	}
+
+	free(pp->samps);
+	free(pp);
+}
+
+static
+uint
+samphash(int normal, int addition, int index, int volume, char *file)
+{
+	uint h;
+	uchar *p;
+
+	h = ((normal * 31 + addition) * 31 + index) * 31 + volume;
+	for (p = (uchar *) file; *p != '\0'; p++)
+		h = 37 * h + *p;
+
+	return h ^ (h >> 15);
+}
+
+/* double the hash chains of pp. pp must be locked */
+static
+void
+growsamppool(samppool *pp)
+{
+	hitsamp **old, *hsp, *next;
+	int i, max;
+
+	old = pp->samps;
+	max = pp->maxsamp;
+	pp->maxsamp *= 2;
+	pp->samps = ecalloc(pp->maxsamp, sizeof(hitsamp *));
+
+	for (i = 0; i < max; i++) {
+		for (hsp = old[i]; hsp != nil; hsp = next) {
+			next = hsp->next;
+			hsp->next = pp->samps[hsp->h & (pp->maxsamp - 1)];
+			pp->samps[hsp->h & (pp->maxsamp - 1)] = hsp;
+		}
+	}
+
+	free(old);
+}
+
+/* return the hitsample in pp with these fields, adding it if it is
+  * not there yet. the caller becomes one of its owners,
+  * and gives it back with nukehitsamp */
+hitsamp *
+sharehitsamp(samppool *pp, int normal, int addition, int index, int volume, char *file)
+{
+	hitsamp *hsp;
+	uint h;
+
+	if (pp == nil || file == nil)
+		return nil;
+
+	h = samphash(normal, addition, index, volume, file);
+	lock(&pp->lk);
+	for (hsp = pp->samps[h & (pp->maxsamp - 1)]; hsp != nil; hsp = hsp->next) {
+		if (hsp->h == h && hsp->normal == normal && hsp->addition == addition
+		&& hsp->index == index && hsp->volume == volume && strcmp(hsp->file, file) == 0) {
+			hsp->ref++;
+			unlock(&pp->lk);
+			return hsp;
+		}
+	}
+
+	if (pp->nsamp >= pp->maxsamp)
+		growsamppool(pp);
+
+	hsp = mkhitsamp(normal, addition, index, volume, estrdup(file));
+	hsp->pool = pp;
+	hsp->ref = 1;
+	hsp->h = h;
+	hsp->next = pp->samps[h & (pp->maxsamp - 1)];
+	pp->samps[h & (pp->maxsamp - 1)] = hsp;
+	pp->nsamp++;
+	unlock(&pp->lk);
+
+	return hsp;
+}
+
+/* give back an owner of a pooled hitsample; see asharehitsamp */
+static
+void
+dropsamp(void *p)
+{
+	nukehitsamp(p);
+}
+
+/* like sharehitsamp, for a record allocated from ap. the owner is
+  * given back when ap is nuked or reset, rather than by anukehitsamp,
+  * so that ap can be released without visiting the record */
+hitsamp *
+asharehitsamp(arena *ap, samppool *pp, int normal, int addition, int index, int volume, char *file)
+{
+	hitsamp *hsp;
+
+	hsp = sharehitsamp(pp, normal, addition, index, volume, file);
+	if (hsp != nil)
+		adefer(ap, dropsamp, hsp);
+
+	return hsp;
 }
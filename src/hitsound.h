@@ -13,14 +13,41 @@ enum additionbits {
 	ADBCLAP = 0x8,
 } additionbits;
 
+typedef struct samppool samppool;
+
 typedef struct hitsamp hitsamp;
 typedef struct hitsamp {
 	int normal;		/* sample set for the 'normal' sound */
 	int addition;		/* sample set for whistle, finish and clap sounds */
 	int index;			/* custom sample index; negative values indicate that no index was selected */
 	int volume;		/* sample volume percentage; negative values indicate that no volume was set */
-	Rune *file;			/* filename for custom addition sound; nil value indicates that hitsample definition had no 'file' field. */
+	char *file;			/* UTF-8 filename for custom addition sound; nil value indicates that hitsample definition had no 'file' field. */
+	Rune *filerunes;	/* Rune view of file; nil until sampfilerunes decodes it */
+	arena *arena;		/* arena the hitsample was allocated from, or nil; filerunes is decoded there too */
+
+	samppool *pool;	/* pool the hitsample is shared through; nil if it has a single owner */
+	long ref;			/* number of owners of a pooled hitsample */
+	uint h;			/* hash of a pooled hitsample */
+	hitsamp *next;		/* next in the pool's hash chain */
 } hitsamp;
 
-hitsamp *mkhitsamp(int normal, int addition, int index, int volume, Rune *file);
+/* identical hitsamples, shared by every object that uses one. may be
+  * shared by many beatmaps and procs. pooled hitsamples must not be
+  * modified; see edithitsamp in hitobject.c */
+typedef struct samppool {
+	Lock lk;
+	hitsamp **samps;	/* hash chains */
+	int maxsamp;		/* number of chains; a power of two */
+	long nsamp;		/* number of distinct hitsamples in the pool */
+} samppool;
+
+hitsamp *mkhitsamp(int normal, int addition, int index, int volume, char *file);
+hitsamp *amkhitsamp(arena *ap, int normal, int addition, int index, int volume, char *file);
+hitsamp *acopyhitsamp(arena *ap, hitsamp *hsp);
 void nukehitsamp(hitsamp *hsp);
+void anukehitsamp(arena *ap, hitsamp *hsp);
+Rune *sampfilerunes(hitsamp *hsp);
+samppool *mksamppool(void);
+void nukesamppool(samppool *pp);
+hitsamp *sharehitsamp(samppool *pp, int normal, int addition, int index, int volume, char *file);
+hitsamp *asharehitsamp(arena *ap, samppool *pp, int normal, int addition, int index, int volume, char *file);
@@ -0,0 +1,318 @@
+#include <u.h>
+#include <libc.h>
+#include "aux.h"
+#include "arena.h"
+#include "hitsound.h"
+#include "hitobject.h"
+#include "objindex.h"
+
+/* create a node with level links for op */
+static
+ixnode *
+mknode(hitobject *op, int level)
+{
+	ixnode *new;
+
+	new = ecalloc(1, sizeof(ixnode) + level * (sizeof(ixnode *) + sizeof(long)));
+	new->op = op;
+	new->level = level;
+	new->next = (ixnode **)(new + 1);
+	new->width = (long *)(new->next + level);
+
+	return new;
+}
+
+/* pick the level of a new node; each level is a quarter as likely as the one below */
+static
+int
+randlevel(objindex *ip)
+{
+	u32int r;
+	int level;
+
+	/* xorshift32 */
+	ip->seed ^= ip->seed << 13;
+	ip->seed ^= ip->seed >> 17;
+	ip->seed ^= ip->seed << 5;
+
+	for (level = 1, r = ip->seed; level < IXMAXLEVEL && (r & 3) == 0; r >>= 2)
+		level++;
+
+	return level;
+}
+
+/* find the last node at or before rank r on each level of ip,
+  * and store it in update, and its rank in rank */
+static
+void
+ixpath(objindex *ip, long r, ixnode **update, long *rank)
+{
+	ixnode *x;
+	long pos;
+	int i;
+
+	x = ip->head;
+	pos = 0;
+	for (i = ip->level - 1; i >= 0; i--) {
+		while (x->next[i] != nil && pos + x->width[i] <= r) {
+			pos += x->width[i];
+			x = x->next[i];
+		}
+		update[i] = x;
+		rank[i] = pos;
+	}
+}
+
+/* returns the node at rank r; the head node for rank 0 */
+static
+ixnode *
+ixnodeat(objindex *ip, long r)
+{
+	ixnode *update[IXMAXLEVEL];
+	long rank[IXMAXLEVEL];
+
+	ixpath(ip, r, update, rank);
+
+	return update[0];
+}
+
+/* count the objects in ip that come before t, or at t as well if le is set.
+  * the last node counted, or the head node, is stored in *xp. */
+static
+long
+ixcount(objindex *ip, double t, int le, ixnode **xp)
+{
+	ixnode *x, *y;
+	long pos;
+	int i;
+
+	x = ip->head;
+	pos = 0;
+	for (i = ip->level - 1; i >= 0; i--) {
+		while ((y = x->next[i]) != nil && (y->op->t < t || (le && y->op->t == t))) {
+			pos += x->width[i];
+			x = y;
+		}
+	}
+
+	*xp = x;
+	return pos;
+}
+
+/* insert a node for op at rank r+1 */
+static
+void
+ixinsert(objindex *ip, long r, hitobject *op)
+{
+	ixnode *update[IXMAXLEVEL], *x;
+	long rank[IXMAXLEVEL];
+	int i, level;
+
+	ixpath(ip, r, update, rank);
+
+	level = randlevel(ip);
+	for (; ip->level < level; ip->level++) {
+		update[ip->level] = ip->head;
+		rank[ip->level] = 0;
+		ip->head->next[ip->level] = nil;
+		ip->head->width[ip->level] = ip->n + 1;
+	}
+
+	x = mknode(op, level);
+	for (i = 0; i < level; i++) {
+		x->next[i] = update[i]->next[i];
+		update[i]->next[i] = x;
+		x->width[i] = update[i]->width[i] - (r - rank[i]);
+		update[i]->width[i] = r - rank[i] + 1;
+	}
+	for (; i < ip->level; i++)
+		update[i]->width[i]++;
+
+	ip->n++;
+}
+
+/* remove and free the node at rank r */
+static
+void
+ixdelete(objindex *ip, long r)
+{
+	ixnode *update[IXMAXLEVEL], *x;
+	long rank[IXMAXLEVEL];
+	int i;
+
+	ixpath(ip, r - 1, update, rank);
+	x = update[0]->next[0];
+
+	for (i = 0; i < ip->level; i++) {
+		if (update[i]->next[i] == x) {
+			update[i]->width[i] += x->width[i] - 1;
+			update[i]->next[i] = x->next[i];
+		} else
+			update[i]->width[i]--;
+	}
+
+	while (ip->level > 1 && ip->head->next[ip->level - 1] == nil)
+		ip->level--;
+
+	ip->n--;
+	free(x);
+}
+
+/* returns the first object in ip, or nil if it is empty */
+static
+hitobject *
+ixhead(objindex *ip)
+{
+	return (ip->head->next[0] != nil) ? ip->head->next[0]->op : nil;
+}
+
+/* index listp, which must be in order */
+objindex *
+mkobjindex(hitobject *listp)
+{
+	objindex *new;
+	hitobject *op;
+
+	new = ecalloc(1, sizeof(objindex));
+	new->head = mknode(nil, IXMAXLEVEL);
+	new->level = 1;
+	new->head->width[0] = 1;
+	new->seed = 0x2545F491;
+
+	for (op = listp; op != nil; op = op->next)
+		ixinsert(new, new->n, op);
+
+	return new;
+}
+
+/* free ip, but not the objects it indexes */
+void
+nukeobjindex(objindex *ip)
+{
+	ixnode *x, *next;
+
+	if (ip == nil)
+		return;
+
+	for (x = ip->head; x != nil; x = next) {
+		next = x->next[0];
+		free(x);
+	}
+
+	free(ip);
+}
+
+/* returns the n-th object in ip like lookupobjn: nil if there is
+  * no n-th object, and the last object if n is 0 */
+hitobject *
+ixobjn(objindex *ip, long n)
+{
+	if (ip == nil || n < 0 || n > ip->n || ip->n == 0)
+		return nil;
+
+	return ixnodeat(ip, (n == 0) ? ip->n : n)->op;
+}
+
+/* returns the object lookupobjt would: the first object with time t,
+  * or the latest one before t, or the first object if there is none */
+hitobject *
+ixobjt(objindex *ip, double t)
+{
+	ixnode *x;
+	long n;
+
+	if (ip == nil || ip->n == 0)
+		return nil;
+
+	n = ixcount(ip, t, 0, &x);
+	if (x->next[0] != nil && x->next[0]->op->t == t)
+		return x->next[0]->op;
+
+	return (n > 0) ? x->op : ixhead(ip);
+}
+
+/* returns the position of op in ip counting from 1, or 0 if op is not in ip */
+long
+ixrank(objindex *ip, hitobject *op)
+{
+	ixnode *x;
+	long r;
+
+	if (ip == nil || op == nil)
+		return 0;
+
+	/* step over the objects that share op's timestamp */
+	r = ixcount(ip, op->t, 0, &x);
+	for (x = x->next[0]; x != nil && x->op->t == op->t; x = x->next[0]) {
+		r++;
+		if (x->op == op)
+			return r;
+	}
+
+	return 0;
+}
+
+/* insert op into ip and its list like addobjt, and return
+  * a pointer to the list's head */
+hitobject *
+ixaddobj(objindex *ip, hitobject *op)
+{
+	hitobject *head;
+	ixnode *x;
+	long r;
+
+	if (ip == nil || op == nil)
+		return nil;
+
+	head = ixhead(ip);
+	if (head == nil || op->t <= head->t) {
+		r = 0;
+		x = ip->head;
+	} else
+		r = ixcount(ip, op->t, 1, &x);
+
+	ixinsert(ip, r, op);
+	if (r == 0)
+		op->next = head;
+	else {
+		op->next = x->op->next;
+		x->op->next = op;
+	}
+
+	return ixhead(ip);
+}
+
+/* remove op from ip and its list like rmobj, and return
+  * a pointer to the list's head */
+hitobject *
+ixrmobj(objindex *ip, hitobject *op)
+{
+	hitobject *prev;
+	long r;
+
+	if (ip == nil || op == nil || (r = ixrank(ip, op)) == 0)
+		return nil;
+
+	prev = (r > 1) ? ixnodeat(ip, r - 1)->op : nil;
+	ixdelete(ip, r);
+	if (prev != nil)
+		prev->next = op->next;
+	op->next = nil;
+
+	return ixhead(ip);
+}
+
+/* change op's time to t and adjust its position like moveobjt,
+  * and return a pointer to the list's head */
+hitobject *
+ixmoveobj(objindex *ip, hitobject *op, double t)
+{
+	if (ip == nil || op == nil || ixrank(ip, op) == 0)
+		return nil;
+
+	ixrmobj(ip, op);
+	op->t = t;
+	op->moved = 1;
+
+	return ixaddobj(ip, op);
+}
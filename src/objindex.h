@@ -0,0 +1,31 @@
+/* order-statistic index over a hitobject list; an indexable skip list
+  * whose nodes point at the objects. the index owns the list's links:
+  * while it is in use, objects must only be added, removed and moved
+  * through the ix* routines. */
+enum {
+	IXMAXLEVEL = 16,	/* enough for 4^16 objects */
+};
+
+typedef struct ixnode ixnode;
+typedef struct ixnode {
+	hitobject *op;	/* nil for the head node */
+	int level;		/* number of elements in next and width */
+	ixnode **next;	/* next node on each level */
+	long *width;	/* number of objects next[i] is ahead of this node; counts up to n+1 past the tail */
+} ixnode;
+
+typedef struct objindex {
+	ixnode *head;	/* rank 0; has IXMAXLEVEL levels */
+	int level;		/* levels in use */
+	long n;		/* number of objects */
+	u32int seed;	/* state of the level generator */
+} objindex;
+
+objindex *mkobjindex(hitobject *listp);
+void nukeobjindex(objindex *ip);
+hitobject *ixobjn(objindex *ip, long n);
+hitobject *ixobjt(objindex *ip, double t);
+long ixrank(objindex *ip, hitobject *op);
+hitobject *ixaddobj(objindex *ip, hitobject *op);
+hitobject *ixrmobj(objindex *ip, hitobject *op);
+hitobject *ixmoveobj(objindex *ip, hitobject *op, double t);
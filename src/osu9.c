@@ -2,13 +2,17 @@
 #include <libc.h>
 #include <bio.h>
 #include <fcall.h>
+#include <thread.h>
 #include "aux.h"
+#include "arena.h"
 #include "hash.h"
 #include "rgbline.h"
 #include "hitsound.h"
 #include "hitobject.h"
 #include "beatmap.h"
 #include "timeline.h"
+#include "batch.h"
+#include "objindex.h"
 
 void
 rotate(int *x, int *y, int ox, int oy, float angle)
@@ -46,7 +50,7 @@ docircle(beatmap *bmp, hitobject *op)
 	n = 0;
 	rlp = lookuprglinet(bmp->rglines, op->t, RLINE);
 	for (u = 0; u <= 6; u += 0.2) {
-		nop = mkobj(TCIRCLE, t, 256 + cos(u)*128, 192 + sin(u)*128);
+		nop = amkobj(bmp->arena, TCIRCLE, t, 256 + cos(u)*128, 192 + sin(u)*128);
 		bmp->objects = addobjt(bmp->objects, nop);
 		t += ticklen(rlp->duration, 8, 1);
 		if (n++ % 4 == 0)
@@ -66,73 +70,475 @@ doncspam(beatmap *bmp, char *s)
 	selected = 0;
 	op = lookupobjstr(bmp->objects, &selected, s);
 	for (n = 0; n < selected; n++) {
-		op->newcombo = 1;
+		setobjcombo(op, 1, op->comboskip);
 		op = op->next;
 	}
 
 	return 0;
 }
 
+/* stream a spiral of circles to bp, with the sections of bmp and
+  * the timing of its first object's redline. every object is built
+  * in the same hitobject, so memory use does not depend on map length. */
 int
-dospiral(beatmap *bmp)
+dospiral(beatmap *bmp, Biobuf *bp)
 {
-	hitobject *np;
+	static int corners[4][2] = {{128, 96}, {384, 96}, {384, 320}, {128, 320}};
+	mapwriter *wp;
+	hitobject o;
+	anchor a;
 	rgline *rlp;
 	double t;
-	int i;
+	int i, n;
 	float angle;
 
+	if (bmp->objects == nil || (rlp = lookuprglinet(bmp->rglines, bmp->objects->t, RLINE)) == nil) {
+		werrstr("no redline for the first object");
+		return -1;
+	}
+	if ((wp = startmap(bp, bmp)) == nil)
+		return -1;
+
+	memset(&o, 0, sizeof(o));
+	o.type = TCIRCLE;
+	o.anchors = &a;
+	o.nanchors = 1;
+
 	i = 0;
 	angle = 0;
-	rlp = lookuprglinet(bmp->rglines, bmp->objects->t, RLINE);
-	bmp->objects = np = mkobj(TCIRCLE, -1, 256, 192);
 	for (t = rlp->t; t <= 100000; t += ticklen(rlp->duration, 16, 1)) {
-		np = addobjt(np, mkobj(TCIRCLE, t++, 128, 96))->next;
-		np = addobjt(np, mkobj(TCIRCLE, t++, 384, 96))->next;
-		np = addobjt(np, mkobj(TCIRCLE, t++, 384, 320))->next;
-		np = addobjt(np, mkobj(TCIRCLE, t++, 128, 320))->next;
+		for (n = 0; n < 4; n++) {
+			if (i++ % 4 == 0)
+				angle += 0.1;
+			o.t = t++;
+			o.newcombo = (i % 16 == 0);
+			a.x = corners[n][0];
+			a.y = corners[n][1];
+			rotate(&a.x, &a.y, 256, 192, angle);
+
+			if (putobj(wp, &o) < 0) {
+				endmap(wp);
+				return -1;
+			}
+		}
 	}
-	np = bmp->objects;
-	bmp->objects = rmobj(bmp->objects, bmp->objects);
-	nukeobj(np);
 
-	i = 0;
-	for (np = bmp->objects; np != nil; np = np->next) {
-		if (i++ % 4 == 0)
-			angle += 0.1;
-		if (i % 16 == 0)
-			np->newcombo = 1;
-		rotate(&np->anchors->x, &np->anchors->y, 256, 192, angle);
+	return (endmap(wp) < 0) ? -1 : 0;
+}
+
+/* move nmove random objects of bmp to random times through an objindex,
+  * and report how long it took */
+void
+domoves(beatmap *bmp, long nmove)
+{
+	objindex *ip;
+	hitobject *op;
+	vlong start;
+	long i, t0, span;
+
+	if (bmp->objects == nil)
+		return;
+
+	ip = mkobjindex(bmp->objects);
+	t0 = ixobjn(ip, 1)->t;
+	span = ixobjn(ip, 0)->t - t0 + 1;
+
+	start = nsec();
+	for (i = 0; i < nmove; i++) {
+		op = ixobjn(ip, 1 + lrand() % ip->n);
+		bmp->objects = ixmoveobj(ip, op, t0 + lrand() % span);
 	}
+	print("%ld moves over %ld objects: %.3fs\n", nmove, ip->n, (nsec() - start) / 1e9);
 
-	return 0;
+	nukeobjindex(ip);
+}
+
+void
+usage(void)
+{
+	fprint(2, "usage: %s [-s] [-m nmove] [-o offset] [-n nproc] file.osu\n", argv0);
+	fprint(2, "       %s -b [-n nproc] [-w outdir] dir | file.osu...\n", argv0);
+	fprint(2, "       %s -t nrep dir | file.osu...\n", argv0);
+	fprint(2, "       %s -f nrand dir | file.osu...\n", argv0);
+	threadexitsall("usage");
+}
+
+/* create a job for every map named by argv, or for every .osu file
+  * in argv[0] if it is the only argument, and store the malloc'd
+  * array in *jobsp. returns the number of jobs. */
+int
+mkjobs(int argc, char *argv[], mapjob **jobsp)
+{
+	mapjob *jobs;
+	int njob;
+	Dir *d;
+
+	jobs = nil;
+	njob = 0;
+	if (argc == 1 && (d = dirstat(argv[0])) != nil && (d->mode & DMDIR)) {
+		free(d);
+		if ((njob = mapjobsdir(argv[0], &jobs)) < 0) {
+			fprint(2, "%s: %r\n", argv[0]);
+			threadexitsall("mapjobsdir");
+		}
+	} else {
+		if (argc == 1)
+			free(d);
+		jobs = ecalloc(argc + 1, sizeof(mapjob));
+		for (njob = 0; njob < argc; njob++)
+			jobs[njob].file = estrdup(argv[njob]);
+	}
+
+	*jobsp = jobs;
+	return njob;
+}
+
+/* read every map named by argv, or every .osu file in argv[0]
+  * if it is the only argument, on nproc procs. if outdir is
+  * non-nil, each map is written back out under outdir. the maps
+  * share one string pool and one hitsample pool. */
+void
+dobatch(int argc, char *argv[], int nproc, char *outdir)
+{
+	mapjob *jobs;
+	strpool *pool;
+	samppool *spool;
+	char *base;
+	int i, njob, nfail;
+
+	njob = mkjobs(argc, argv, &jobs);
+
+	pool = mkstrpool();
+	spool = mksamppool();
+	for (i = 0; i < njob; i++) {
+		jobs[i].pool = pool;
+		jobs[i].samppool = spool;
+	}
+
+	for (i = 0; outdir != nil && i < njob; i++) {
+		if ((base = strrchr(jobs[i].file, '/')) == nil)
+			base = jobs[i].file;
+		else
+			base++;
+		jobs[i].outfile = smprint("%s/%s", outdir, base);
+	}
+
+	nfail = readmaps(jobs, njob, nproc);
+
+	for (i = 0; i < njob; i++) {
+		if (jobs[i].exit < 0)
+			print("%s: error %d: %s\n", jobs[i].file, jobs[i].exit, jobs[i].err);
+		else
+			print("%s: ok\n", jobs[i].file);
+		free(jobs[i].file);
+		free(jobs[i].outfile);
+	}
+	print("%d maps, %d failed\n", njob, nfail);
+	free(jobs);
+	nukestrpool(pool);
+	nukesamppool(spool);
+
+	threadexitsall(nfail > 0 ? "readmaps" : nil);
+}
+
+/* collect the numeric fields of the timing points and objects of the
+  * njob maps in jobs into a malloc'd array of malloc'd strings, stored
+  * in *fieldsp. returns the number of fields. */
+long
+mapfields(mapjob *jobs, int njob, char ***fieldsp)
+{
+	Biobuf *bp;
+	char **fields, *ln, *p, *q;
+	long nfield, maxfield;
+	int j, insec;
+
+	fields = nil;
+	nfield = maxfield = 0;
+	for (j = 0; j < njob; j++) {
+		if ((bp = Bopen(jobs[j].file, OREAD)) == nil) {
+			fprint(2, "%s: %r\n", jobs[j].file);
+			continue;
+		}
+
+		insec = 0;
+		while ((ln = Brdstr(bp, '\n', 1)) != nil) {
+			if (ln[0] == '[')
+				insec = strncmp(ln, "[TimingPoints]", 14) == 0 || strncmp(ln, "[HitObjects]", 12) == 0;
+			else if (insec) {
+				for (p = ln; *p != '\0'; p = q + (*q != '\0')) {
+					q = p + strcspn(p, ",|:\r");
+					if (q == p || !((*p >= '0' && *p <= '9') || *p == '-' || *p == '.'))
+						continue;
+					if (nfield == maxfield) {
+						maxfield = (maxfield > 0) ? maxfield * 2 : 1024;
+						fields = erealloc(fields, maxfield * sizeof(char *));
+					}
+					fields[nfield++] = smprint("%.*s", (int)(q - p), p);
+				}
+			}
+			free(ln);
+		}
+		Bterm(bp);
+	}
+
+	*fieldsp = fields;
+	return nfield;
+}
+
+/* collect the numeric fields of the timing points and objects of every
+  * map named by argv, as mkjobs finds them, and time spantol and spantod
+  * against atol and strtod over them, nrep times each */
+void
+dospans(int argc, char *argv[], long nrep)
+{
+	mapjob *jobs;
+	char **fields;
+	long nfield, i, r, nbad;
+	vlong start, lsum, asum;
+	double dsum, ssum, tl, ta, td, ts, n;
+	int j, njob;
+
+	njob = mkjobs(argc, argv, &jobs);
+	nfield = mapfields(jobs, njob, &fields);
+	for (j = 0; j < njob; j++)
+		free(jobs[j].file);
+	free(jobs);
+
+	if (nfield == 0) {
+		fprint(2, "no numeric fields\n");
+		threadexitsall("dospans");
+	}
+	n = (double)nfield * nrep;
+
+	lsum = asum = 0;
+	dsum = ssum = 0;
+	start = nsec();
+	for (r = 0; r < nrep; r++)
+		for (i = 0; i < nfield; i++)
+			lsum += spantol(fields[i], -1);
+	tl = (nsec() - start) / n;
+	start = nsec();
+	for (r = 0; r < nrep; r++)
+		for (i = 0; i < nfield; i++)
+			asum += atol(fields[i]);
+	ta = (nsec() - start) / n;
+	start = nsec();
+	for (r = 0; r < nrep; r++)
+		for (i = 0; i < nfield; i++)
+			dsum += spantod(fields[i], -1);
+	td = (nsec() - start) / n;
+	start = nsec();
+	for (r = 0; r < nrep; r++)
+		for (i = 0; i < nfield; i++)
+			ssum += strtod(fields[i], nil);
+	ts = (nsec() - start) / n;
+
+	nbad = 0;
+	for (i = 0; i < nfield; i++) {
+		if (spantol(fields[i], -1) != atol(fields[i]) || spantod(fields[i], -1) != strtod(fields[i], nil))
+			nbad++;
+		free(fields[i]);
+	}
+	free(fields);
+
+	print("%ld numeric fields from %d maps, %ld reps\n", nfield, njob, nrep);
+	print("spantol %.1fns/field, atol %.1fns/field\n", tl, ta);
+	print("spantod %.1fns/field, strtod %.1fns/field\n", td, ts);
+	print("%ld fields differ%s\n", nbad, (lsum != asum || dsum != ssum) ? ", sums differ" : "");
+
+	threadexitsall(nbad > 0 ? "dospans" : nil);
 }
 
+/* compare dtostr(v, prec) with "%.precG" for v, and report a mismatch.
+  * returns 1 if they differ. */
+int
+cmpdtostr(double v, int prec)
+{
+	char got[32], want[32];
+
+	dtostr(got, v, prec);
+	snprint(want, sizeof want, "%.*G", (prec < 0) ? 6 : (prec == 0) ? 1 : prec, v);
+	if (strcmp(got, want) == 0)
+		return 0;
+	fprint(2, "dtostr(%.17G, %d) = %s, want %s\n", v, prec, got, want);
+	return 1;
+}
+
+/* check dtostr against snprint: nrand random values at every
+  * precision from -1 to 17, integers on either side of each power
+  * of ten, -0, and every numeric field of the maps named by argv at
+  * the precisions writemap uses, 16 and 11 */
 void
-main(int argc, char *argv[])
+dodtostr(int argc, char *argv[], long nrand)
+{
+	union {
+		double d;
+		uvlong u;
+	} bits;
+	mapjob *jobs;
+	char **fields;
+	vlong k;
+	long nfield, i, n, nbad, seed;
+	int j, njob, prec, d;
+
+	seed = truerand();
+	srand(seed);
+
+	n = nbad = 0;
+	for (prec = -1; prec <= 17; prec++) {
+		for (k = 1, d = 0; d <= 17; k *= 10, d++)
+			for (i = -2; i <= 2; i++) {
+				nbad += cmpdtostr(k + i, prec) + cmpdtostr(-(k + i), prec);
+				nbad += cmpdtostr((k + i) / 10.0, prec);
+				n += 3;
+			}
+		nbad += cmpdtostr(-0.0, prec) + cmpdtostr(0.5, prec);
+		n += 2;
+
+		for (i = 0; i < nrand; i++) {
+			/* any bit pattern, an integer of up to 17 digits,
+			  * and one with up to three decimals */
+			bits.u = (uvlong)lrand() << 33 ^ (uvlong)lrand() << 2 ^ lrand();
+			k = ((vlong)lrand() << 31 | lrand()) % 100000000000000000LL;
+			for (d = lrand() % 17; d > 0; d--)
+				k /= 10;
+			if (lrand() & 1)
+				k = -k;
+			nbad += cmpdtostr(bits.d, prec) + cmpdtostr(k, prec);
+			nbad += cmpdtostr(k / 1000.0, prec);
+			n += 3;
+		}
+	}
+
+	njob = mkjobs(argc, argv, &jobs);
+	nfield = mapfields(jobs, njob, &fields);
+	for (j = 0; j < njob; j++)
+		free(jobs[j].file);
+	free(jobs);
+	for (i = 0; i < nfield; i++) {
+		nbad += cmpdtostr(strtod(fields[i], nil), 16) + cmpdtostr(strtod(fields[i], nil), 11);
+		n += 2;
+		free(fields[i]);
+	}
+	free(fields);
+
+	print("%ld values, %ld numeric fields from %d maps, seed %ld\n", n, nfield, njob, seed);
+	print("%ld differ\n", nbad);
+
+	threadexitsall(nbad > 0 ? "dtostr" : nil);
+}
+
+void
+threadmain(int argc, char *argv[])
 {
 	beatmap *bmp;
 	Biobuf *bfile, *boutfile;
+	char *s, *outdir;
+	int batch, spiral, nproc;
+	long nmove, nrep, nrand;
+	tshift ts;
 
-	if (argc < 2) {
-		fprint(2, "usage: %s file.osu\n", argv[0]);
-		exits("usage");
+	batch = 0;
+	spiral = 0;
+	nproc = 0;
+	nmove = 0;
+	nrep = 0;
+	nrand = 0;
+	ts.delta = 0;
+	outdir = nil;
+	ARGBEGIN {
+	case 'b':
+		batch = 1;
+		break;
+	case 'f':
+		nrand = atol(EARGF(usage()));
+		break;
+	case 'm':
+		nmove = atol(EARGF(usage()));
+		break;
+	case 'n':
+		nproc = atoi(EARGF(usage()));
+		break;
+	case 'o':
+		ts.delta = atof(EARGF(usage()));
+		break;
+	case 's':
+		spiral = 1;
+		break;
+	case 't':
+		nrep = atol(EARGF(usage()));
+		break;
+	case 'w':
+		outdir = EARGF(usage());
+		break;
+	default:
+		usage();
+	} ARGEND
+
+	if (argc < 1)
+		usage();
+
+	if (nproc < 1 && (s = getenv("NPROC")) != nil) {
+		nproc = atoi(s);
+		free(s);
 	}
 
-	bfile = Bopen(argv[1], OREAD);
+	if (batch)
+		dobatch(argc, argv, nproc, outdir);
+	if (nrep > 0)
+		dospans(argc, argv, nrep);
+	if (nrand > 0)
+		dodtostr(argc, argv, nrand);
+
+	bfile = Bopen(argv[0], OREAD);
 	if (bfile == nil) {
 		fprint(2, "%r\n");
-		exits("Bopen");
+		threadexitsall("Bopen");
 	}
 
+	initsplit();
 	bmp = mkbeatmap();
+	bmp->arena = mkarena(0);
+	bmp->nproc = nproc;
 	if (readmap(bfile, bmp) < 0) {
 		Bterm(bfile);
 		fprint(2, "%r\n");
-		exits("readmap");
+		threadexitsall("readmap");
 	}
 	Bterm(bfile);
 
+	if (nmove > 0) {
+		domoves(bmp, nmove);
+		nukebeatmap(bmp);
+		threadexitsall(nil);
+	}
+
+	if (ts.delta != 0) {
+		ts.from = Inf(-1);
+		ts.to = Inf(1);
+		if (shiftmap(bmp, &ts, 1) < 0) {
+			fprint(2, "%r\n");
+			nukebeatmap(bmp);
+			threadexitsall("shiftmap");
+		}
+		boutfile = ecalloc(1, sizeof(Biobuf));
+		Binit(boutfile, 1, OWRITE);
+		writemap(boutfile, bmp);
+		Bterm(boutfile);
+		nukebeatmap(bmp);
+		threadexitsall(nil);
+	}
+
+	if (spiral) {
+		boutfile = ecalloc(1, sizeof(Biobuf));
+		Binit(boutfile, 1, OWRITE);
+		if (dospiral(bmp, boutfile) < 0)
+			fprint(2, "%r\n");
+		Bterm(boutfile);
+		nukebeatmap(bmp);
+		threadexitsall(nil);
+	}
+
 	hitobject *op;
 	rgline *rlp;
 
@@ -140,10 +546,16 @@ main(int argc, char *argv[])
 	if (rlp == nil)
 		print("Nil\'n");
 
-	for (op = bmp->objects; op != nil; op = op->next) {
-		bmp->objects = moveobjt(bmp->objects, op, op->t + 20);
-		op->newcombo = 1;
+	ts.from = Inf(-1);
+	ts.to = Inf(1);
+	ts.delta = 20;
+	if (shiftmap(bmp, &ts, 1) < 0) {
+		fprint(2, "%r\n");
+		nukebeatmap(bmp);
+		threadexitsall("shiftmap");
 	}
+	for (op = bmp->objects; op != nil; op = op->next)
+		setobjcombo(op, 1, op->comboskip);
 
 	boutfile = ecalloc(1, sizeof(Biobuf));
 	Binit(boutfile, 1, OWRITE);
@@ -152,4 +564,5 @@ main(int argc, char *argv[])
 	Bterm(boutfile);
 	nukebeatmap(bmp);
 
+	threadexitsall(nil);
 }
@@ -1,18 +1,26 @@
 #include <u.h>
 #include <libc.h>
 #include "aux.h"
+#include "arena.h"
 #include "rgbline.h"
 
 /* create a new line */
 rgline *
 mkrgline(double t, double vord, int beats, int type)
+{
+	return amkrgline(nil, t, vord, beats, type);
+}
+
+/* create a new line in arena ap, or on the heap if ap is nil */
+rgline *
+amkrgline(arena *ap, double t, double vord, int beats, int type)
 {
 	rgline *new;
 
 	if (type < GLINE || type > RLINE)
 		return nil;
 
-	new = ecalloc(1, sizeof(rgline));
+	new = aalloc(ap, sizeof(rgline));
 	new->t = t;
 	new->beats = beats;
 
@@ -31,7 +39,18 @@ mkrgline(double t, double vord, int beats, int type)
 void
 nukergline(rgline *lp)
 {
-	free(lp);
+	anukergline(nil, lp);
+}
+
+/* free a line like nukergline, unless it was allocated from ap */
+void
+anukergline(arena *ap, rgline *lp)
+{
+	if (lp == nil)
+		return;
+
+	afree(ap, lp->src);
+	afree(ap, lp);
 }
 
 /* inserts a line into listp based on its time value.
@@ -81,15 +100,120 @@ addrglinet(rgline *listp, rgline *lp)
 	return nil; /* unreachable */
 }
 
+/* appends lp to listp in constant time for bulk loading, and returns a
+  * pointer to the list's head. *tailp tracks the last line in listp; if it
+  * is nil, loadrgline finds it. listp must be put in order by a single call
+  * to sortrglinet once loading is done.
+  * returns nil if lp is nil, or lp->type is invalid */
+rgline *
+loadrgline(rgline *listp, rgline **tailp, rgline *lp)
+{
+	if (lp == nil || tailp == nil || lp->type < GLINE || lp->type > RLINE)
+		return nil;
+
+	lp->next = nil;
+	if (listp == nil) {
+		*tailp = lp;
+		return lp;
+	}
+
+	if (*tailp == nil)
+		for (*tailp = listp; (*tailp)->next != nil; *tailp = (*tailp)->next)
+			;
+
+	(*tailp)->next = lp;
+	*tailp = lp;
+
+	return listp;
+}
+
+/* returns 1 if line a must precede line b in a list; redlines
+  * precede greenlines with the same timestamp */
+static
+int
+rglinebefore(rgline *a, rgline *b)
+{
+	return a->t < b->t || (a->t == b->t && a->type == RLINE && b->type == GLINE);
+}
+
+/* sorts listp by time value with a stable merge sort, such that no
+  * greenline precedes a redline with the same timestamp. lines with equal
+  * type and timestamp keep their relative order. lists that are already
+  * in order are returned after a single pass.
+  * returns a pointer to the list's head */
+rgline *
+sortrglinet(rgline *listp)
+{
+	rgline *p, *q, *e, *tail;
+	int insize, nmerges, psize, qsize, i;
+
+	for (p = listp; p != nil && p->next != nil; p = p->next)
+		if (rglinebefore(p->next, p))
+			break;
+
+	if (p == nil || p->next == nil)
+		return listp;
+
+	for (insize = 1;; insize *= 2) {
+		p = listp;
+		listp = tail = nil;
+		nmerges = 0;
+
+		while (p != nil) {
+			nmerges++;
+			q = p;
+			for (psize = 0, i = 0; i < insize && q != nil; i++, psize++)
+				q = q->next;
+			qsize = insize;
+
+			while (psize > 0 || (qsize > 0 && q != nil)) {
+				if (psize == 0 || (qsize > 0 && q != nil && rglinebefore(q, p))) {
+					e = q;
+					q = q->next;
+					qsize--;
+				} else {
+					e = p;
+					p = p->next;
+					psize--;
+				}
+
+				if (tail != nil)
+					tail->next = e;
+				else
+					listp = e;
+				tail = e;
+			}
+
+			p = q;
+		}
+
+		tail->next = nil;
+
+		if (nmerges <= 1)
+			return listp;
+	}
+}
+
 /* change line lp's time to t and adjust its position in listp */
 rgline *
-movergline(rgline *listp, rgline *lp, double t)
+moverglinet(rgline *listp, rgline *lp, double t)
 {
 	listp = rmrgline(listp, lp);
 	lp->t = t;
+	lp->moved = 1;
 	return addrglinet(listp, lp);
 }
 
+/* mark lp as modified, so that writemap formats it instead of writing
+  * back the text it was parsed from. must be called after changing
+  * any of lp's fields directly. */
+void
+dirtyrgline(rgline *lp)
+{
+	if (lp != nil)
+		lp->dirty = 1;
+}
+
 /* remove the line pointed to by lp from listp */
 rgline *
 rmrgline(rgline *listp, rgline *lp)
@@ -132,4 +256,117 @@ lookuprglinet(rgline *listp, double t, int type)
 	}
 
 	return found;
-}
\ No newline at end of file
+}
+
+/* index the lines in listp, which must be in order. lines of any
+  * other type than GLINE or RLINE are left out, as lookuprglinet
+  * never returns them either. */
+rgindex *
+mkrgindex(rgline *listp)
+{
+	rgindex *new;
+	rgline *np;
+	long i[2];
+
+	new = ecalloc(1, sizeof(rgindex));
+	for (np = listp; np != nil; np = np->next)
+		if (np->type == GLINE || np->type == RLINE)
+			new->n[np->type]++;
+
+	new->lines[GLINE] = ecalloc(new->n[GLINE] + 1, sizeof(rgline *));
+	new->lines[RLINE] = ecalloc(new->n[RLINE] + 1, sizeof(rgline *));
+
+	i[GLINE] = i[RLINE] = 0;
+	for (np = listp; np != nil; np = np->next)
+		if (np->type == GLINE || np->type == RLINE)
+			new->lines[np->type][i[np->type]++] = np;
+
+	return new;
+}
+
+/* free ip, but not the lines it points to */
+void
+nukergindex(rgindex *ip)
+{
+	if (ip == nil)
+		return;
+
+	free(ip->lines[GLINE]);
+	free(ip->lines[RLINE]);
+	free(ip);
+}
+
+/* returns the index of the last line of type in ip whose time value
+  * is equal to or less than t, or -1 if there is none */
+static
+long
+searchrgindex(rgindex *ip, double t, int type)
+{
+	rgline **v;
+	long lo, hi, mid;
+
+	v = ip->lines[type];
+	lo = 0;
+	hi = ip->n[type];
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (v[mid]->t <= t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo - 1;
+}
+
+/* returns what lookuprglinet would for the list ip was made from,
+  * with a binary search */
+rgline *
+rgindext(rgindex *ip, double t, int type)
+{
+	long i;
+
+	if (ip == nil || type < GLINE || type > RLINE)
+		return nil;
+
+	i = searchrgindex(ip, t, type);
+
+	return (i >= 0) ? ip->lines[type][i] : nil;
+}
+
+/* start a sweep over the lines of type in ip */
+void
+initrgcursor(rgcursor *cp, rgindex *ip, int type)
+{
+	if (cp == nil)
+		return;
+
+	cp->ip = ip;
+	cp->type = type;
+	cp->i = -1;
+}
+
+/* returns what rgindext would for t. when t does not decrease from one
+  * call to the next, as while walking objects in time order, the cursor
+  * only steps forward, so a whole sweep costs O(n + m). going back in
+  * time falls back to a binary search. */
+rgline *
+rgcursort(rgcursor *cp, double t)
+{
+	rgline **v;
+	long n;
+
+	if (cp == nil || cp->ip == nil || cp->type < GLINE || cp->type > RLINE)
+		return nil;
+
+	v = cp->ip->lines[cp->type];
+	n = cp->ip->n[cp->type];
+
+	if (cp->i >= 0 && v[cp->i]->t > t)
+		cp->i = searchrgindex(cp->ip, t, cp->type);
+	else
+		while (cp->i + 1 < n && v[cp->i + 1]->t <= t)
+			cp->i++;
+
+	return (cp->i >= 0) ? v[cp->i] : nil;
+}
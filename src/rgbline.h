@@ -27,11 +27,39 @@ typedef struct rgline {
 	int sampindex;	/* custom sample index; 0 for default */
 	int volume;	/* volume percentage */
 
+	char *src;		/* definition the line was parsed from, if any */
+	int dirty;		/* line was modified since parsing; clean lines are written back as src */
+	int moved;		/* only t was changed; a clean line is written back as src with the new time */
 } line;
 
+/* the red and green lines of a sorted list in two arrays, for lookups
+  * by time. an index holds pointers into the list it was made from,
+  * and must be remade once that list changes. */
+typedef struct rgindex {
+	rgline **lines[2];	/* lines of each type in list order, indexed by enum linetype */
+	long n[2];		/* number of elements in lines[type] */
+} rgindex;
+
+/* position of a sweep over one type of line in an rgindex; see rgcursort */
+typedef struct rgcursor {
+	rgindex *ip;
+	int type;		/* one of enum linetype */
+	long i;		/* index of the line found last, or -1 */
+} rgcursor;
+
 rgline *mkrgline(double t, double vord, int beats, int type);
+rgline *amkrgline(arena *ap, double t, double vord, int beats, int type);
 void nukergline(rgline *lp);
+void anukergline(arena *ap, rgline *lp);
 rgline *addrglinet(rgline *listp, rgline *lp);
+rgline *loadrgline(rgline *listp, rgline **tailp, rgline *lp);
+rgline *sortrglinet(rgline *listp);
 rgline *moverglinet(rgline *listp, rgline *lp, double t);
+void dirtyrgline(rgline *lp);
 rgline *rmrgline(rgline *listp, rgline *lp);
 rgline *lookuprglinet(rgline *listp, double t, int type);
+rgindex *mkrgindex(rgline *listp);
+void nukergindex(rgindex *ip);
+rgline *rgindext(rgindex *ip, double t, int type);
+void initrgcursor(rgcursor *cp, rgindex *ip, int type);
+rgline *rgcursort(rgcursor *cp, double t);
@@ -1,5 +1,6 @@
 #include <u.h>
 #include <libc.h>
+#include "arena.h"
 #include "hitsound.h"
 #include "rgbline.h"
 #include "hitobject.h"